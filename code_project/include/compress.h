@@ -0,0 +1,46 @@
+// Chunk compression header.
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+// Compression methods that can be announced in the start packet.
+#define COMPRESS_NONE 0
+#define COMPRESS_LZ 1 // LZ77 with a byte oriented format (like LZ4 blocks)
+
+#define COMPRESS_HISTORY_SIZE 65535 // Bytes before a chunk that its matches can use
+#define COMPRESS_MAX_CHUNK 65535
+#define COMPRESS_HASH_LOG 12
+
+// A stream of chunks. Both sides keep the chunks already sent (compressed or
+// not) as history, so a chunk can refer to the data of the ones before it.
+typedef struct
+{
+    unsigned char window[2 * COMPRESS_HISTORY_SIZE + COMPRESS_MAX_CHUNK];
+    int length;                         // Bytes in window
+    int table[1 << COMPRESS_HASH_LOG]; // Last position of each hash of 4 bytes
+} CompressStream;
+
+// Start a stream without history.
+void compressStreamInit(CompressStream *stream);
+
+// Place in the window for the next chunk of size bytes (at most
+// COMPRESS_MAX_CHUNK). Old history is dropped to make room.
+unsigned char *compressStreamNext(CompressStream *stream, int size);
+
+// Add the size bytes written at compressStreamNext to the history.
+void compressStreamCommit(CompressStream *stream, int size);
+
+// Compress the size bytes written at compressStreamNext into dst, that has
+// room for dstCapacity bytes, and add them to the history. Return the
+// compressed size, or 0 if it doesn't fit (the chunk doesn't compress enough
+// and should be sent as it is). The work stops as soon as the output is full,
+// and data that doesn't repeat is skipped faster and faster, so testing a
+// chunk costs at most one quick pass over it.
+int compressStreamChunk(CompressStream *stream, unsigned char *dst, int dstCapacity, int size);
+
+// Decompress size bytes of src, that must give expected bytes, into the
+// window and add them to the history. Return where the data starts, or NULL
+// if the data is malformed.
+const unsigned char *decompressStreamChunk(CompressStream *stream, const unsigned char *src, int size, int expected);
+
+#endif // _COMPRESS_H_
@@ -0,0 +1,43 @@
+// Event loop header.
+// Waits for the serial port and for the link layer timers with epoll and a timerfd,
+// and can be woken from another thread with an eventfd.
+
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+// Number of timers that can run at the same time.
+#define MAX_TIMERS 16
+
+// Function called when a timer expires, with the id of the timer.
+typedef void (*TimerHandler)(int timerId);
+
+// Create the event loop for the serial port file descriptor fd.
+// Returns -1 on error.
+int eventLoopOpen(int fd);
+
+// Stop every timer and close the event loop.
+void eventLoopClose();
+
+// Start (or restart) the timer timerId (0 to MAX_TIMERS - 1) to expire in
+// timeoutMs milliseconds and call handler.
+// Returns -1 on error.
+int startTimer(int timerId, int timeoutMs, TimerHandler handler);
+
+// Stop the timer timerId without calling its handler.
+void stopTimer(int timerId);
+
+// Current time of the monotonic clock in milliseconds.
+long long currentTimeMs();
+
+// Make the eventLoopWait running in another thread return 0 (the thread that
+// waits for the serial port can then check work given by another one). Safe
+// to call from any thread.
+void eventLoopWake();
+
+// Wait up to waitMs milliseconds for bytes in the serial port, calling the
+// handlers of the timers that expire meanwhile.
+// Returns -1 on error, 0 if no bytes arrived (or a timer expired, or
+// eventLoopWake was called), 1 if there are bytes to read.
+int eventLoopWait(int waitMs);
+
+#endif // _EVENT_LOOP_H_
@@ -0,0 +1,38 @@
+// Frame check sequence header.
+
+#ifndef _FCS_H_
+#define _FCS_H_
+
+#include <stdint.h>
+
+// Frame check sequences that can be negotiated in llopen.
+#define FCS_BCC2 0   // 1 byte XOR of the data (original protocol)
+#define FCS_CRC32C 1 // 4 byte CRC-32C (Castagnoli), least significant byte first
+
+// Size of the biggest frame check sequence.
+#define MAX_FCS_SIZE 4
+
+// Number of bytes of the frame check sequence fcsType.
+int fcsSize(int fcsType);
+
+// Name of the frame check sequence fcsType.
+const char *fcsName(int fcsType);
+
+// Compute the frame check sequence fcsType of size bytes of data into fcs.
+void computeFcs(int fcsType, const unsigned char *data, int size, unsigned char *fcs);
+
+// Running check of received data followed by its frame check sequence.
+// Start with fcsCheckStart, add the bytes as they arrive with fcsCheckUpdate
+// and the frame is intact if fcsCheckOk is true after the last one.
+uint32_t fcsCheckStart(int fcsType);
+uint32_t fcsCheckUpdate(int fcsType, uint32_t check, const unsigned char *data, int size);
+int fcsCheckOk(int fcsType, uint32_t check);
+
+// Update a CRC-32C with size bytes of data. The caller does the initial and
+// final inversion (crc starts as 0xFFFFFFFF and the result is inverted).
+uint32_t crc32cUpdate(uint32_t crc, const unsigned char *data, int size);
+
+// Name of the CRC-32C kernel chosen for this CPU ("sse4.2" or "slice-by-8").
+const char *crc32cKernel();
+
+#endif // _FCS_H_
@@ -0,0 +1,79 @@
+// File output header.
+// Writes a file with few big writes: the data is gathered in aligned buffers
+// and each full buffer is written at once, with pwrite or with io_uring.
+
+#ifndef _FILE_OUTPUT_H_
+#define _FILE_OUTPUT_H_
+
+// Ways to write the buffers.
+#define OUTPUT_STDIO 0 // Not used by this module: the caller writes with stdio
+#define OUTPUT_PWRITE 1 // One pwrite per buffer
+#define OUTPUT_URING 2 // Writes submitted to an io_uring, several buffers in flight
+
+#define OUTPUT_BUFFERS 4
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+#define OUTPUT_ALIGN 4096 // Alignment of the buffers, and of the writes with O_DIRECT
+
+typedef struct
+{
+    int fd;
+    int backend;
+    int direct; // Opened with O_DIRECT: the writes are whole aligned blocks
+    unsigned char *buffers[OUTPUT_BUFFERS];
+    int busy[OUTPUT_BUFFERS]; // Write of the buffer still in flight (io_uring)
+    int current; // Buffer being filled
+    long bufferOffset; // Position in the file of the first byte of the current buffer
+    int length; // Bytes in the current buffer
+    long end; // End of the data given to the output
+
+    // io_uring (OUTPUT_URING)
+    int ring;
+    void *sqRing;
+    void *cqRing;
+    void *sqes;
+    long sqRingSize;
+    long cqRingSize;
+    long sqesSize;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    void *cqes;
+    int inFlight;
+
+    // Statistics
+    long long writes; // Write system calls or submissions
+    long long bytes;
+} FileOutput;
+
+// Open path to write data from offset on (the bytes before it are kept, the
+// file is truncated if offset is 0). The backend falls back to OUTPUT_PWRITE
+// without io_uring, and to buffered writes if the file system refuses O_DIRECT.
+// Returns -1 on error.
+int outputOpen(FileOutput *output, const char *path, long offset, int backend, int direct);
+
+// Add size bytes of data at offset. The data is written when a buffer is full.
+// Returns -1 on error.
+int outputWrite(FileOutput *output, long offset, const unsigned char *data, int size);
+
+// Write the data still in the buffers and wait for every write to complete,
+// then fdatasync the file if durable.
+// Returns -1 on error.
+int outputSync(FileOutput *output, int durable);
+
+// Write the whole blocks (OUTPUT_ALIGN bytes) in the buffers and wait for
+// every write to complete, then fdatasync the file if durable. The bytes of the
+// last incomplete block stay in the buffer, for the writes that follow.
+// Returns -1 on error, otherwise where the data written ends in the file.
+long outputCheckpoint(FileOutput *output, int durable);
+
+// Sync (like outputSync) and close the file.
+// Returns -1 on error.
+int outputClose(FileOutput *output, int durable);
+
+// Name of the backend in use.
+const char *outputName(FileOutput *output);
+
+#endif // _FILE_OUTPUT_H_
@@ -0,0 +1,42 @@
+// Link layer extensions header.
+// Functions of the link layer besides the ones of link_layer.h (which must not
+// be changed).
+
+#ifndef _LINK_LAYER_EXT_H_
+#define _LINK_LAYER_EXT_H_
+
+#include "link_layer.h"
+
+// Biggest resume information exchanged in llopen (see llsetresume)
+#define MAX_RESUME_SIZE 16
+
+// Zero-copy send: space for size bytes (at most llpayloadsize()) inside the
+// next frame, where the data can be written directly. Transmitter only.
+// Return NULL on error.
+unsigned char *llreserve(int size);
+
+// Send the size bytes written in the space given by llreserve.
+// Return number of chars written, or "-1" on error.
+int llcommit(int size);
+
+// Zero-copy receive: points packet to the data received inside the link
+// layer, valid until the next call to llread or llreadview.
+// Return number of chars of the packet, 0 if the connection was closed or "-1" on error.
+int llreadview(const unsigned char **packet);
+
+// Resumable transfers: information of the application (at most
+// MAX_RESUME_SIZE bytes) that the receiver gives to the transmitter in llopen.
+// Before llopen, the receiver calls llsetresume with its information and the
+// transmitter calls llsetresume(NULL, 0) to ask for it. After llopen,
+// llgetresume copies into info what the receiver gave and returns its size,
+// 0 if it gave nothing. llsetresume returns "-1" if size is too big.
+int llsetresume(const unsigned char *info, int size);
+int llgetresume(unsigned char *info);
+
+// Number of bytes the application layer should give to each llwrite,
+// at most the maximum information field agreed in llopen (MAX_PAYLOAD_SIZE if
+// the other side doesn't negotiate it). It follows the errors of the link, so
+// it can change after each llwrite.
+int llpayloadsize();
+
+#endif // _LINK_LAYER_EXT_H_
@@ -0,0 +1,32 @@
+// Serial line header.
+// What the link layer needs from a serial port besides the interface of
+// serial_port.h (which must not be changed), built on the port it opens.
+
+#ifndef _SERIAL_LINE_H_
+#define _SERIAL_LINE_H_
+
+// Open and configure the serial port with openSerialPort, then set its read
+// policy (SERIAL_VMIN and SERIAL_VTIME).
+// Returns the file descriptor of the port, -1 on error.
+int openSerialLine(const char *serialPort, int baudRate);
+
+// Close the serial port with closeSerialPort.
+// Returns -1 on error.
+int closeSerialLine();
+
+// Wait up to VTIME for bytes received from the serial port and read up to
+// numBytes of the ones available.
+// Returns -1 on error, otherwise the number of bytes read (0 if none).
+int readSerialLine(unsigned char *bytes, int numBytes);
+
+// Write up to numBytes to the serial port with writeBytesSerialPort and count
+// the time the line needs to send them.
+// Returns -1 on error, otherwise the number of bytes written.
+int writeSerialLine(const unsigned char *bytes, int numBytes);
+
+// Wait until the bytes queued in the serial port have been transmitted, as long
+// as the baud rate needs for them.
+// Returns -1 on error.
+int drainSerialLine();
+
+#endif // _SERIAL_LINE_H_
@@ -0,0 +1,29 @@
+// Byte stuffing header.
+// Copies data into and out of frames, escaping the flag (0x7E) and escape (0x7D) bytes,
+// a block at a time with SIMD instructions when the CPU has them.
+
+#ifndef _STUFFING_H_
+#define _STUFFING_H_
+
+// Copy size bytes of src to dst with byte stuffing and compute the frame check
+// sequence fcsType (see fcs.h) of src in the same pass into fcs.
+// dst must have room for 2 * size bytes (the worst case of the stuffing).
+// Returns the number of bytes written to dst.
+int stuffData(unsigned char *dst, const unsigned char *src, int size, int fcsType, unsigned char *fcs);
+
+// Copy src to dst undoing the byte stuffing, until a flag byte (not consumed),
+// the end of src or dstSize bytes written. *escaped keeps an escape byte that
+// was the last byte of src for the next call (start with 0).
+// Saves the number of bytes written in *written and returns the number of
+// bytes of src consumed.
+int destuffData(unsigned char *dst, int dstSize, const unsigned char *src, int size, int *written, int *escaped);
+
+// Name of the stuffing kernel chosen for this CPU ("avx2", "sse2" or "scalar").
+const char *stuffingKernel();
+
+// Use the stuffing and destuffing kernels called name ("avx2", "sse2" or
+// "scalar") instead of the ones chosen for this CPU, for the tests.
+// Returns -1 if the CPU doesn't support them.
+int useStuffingKernel(const char *name);
+
+#endif // _STUFFING_H_
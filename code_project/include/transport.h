@@ -0,0 +1,42 @@
+// Transport header.
+// The byte stream of the link layer, chosen from the prefix of the port string.
+// A port without a known prefix is a serial port (serial_line.h). The other
+// transports move the bytes at memory speed (there is no baud rate), so the
+// protocol can run without a serial port or the virtual cable:
+//   "pty:PATH": a pseudo terminal pair. The first side creates the pair and
+//   links PATH to its slave, the other side opens PATH (as "pty:PATH" or as a
+//   serial port, with the baud rate of the serial port).
+//   "socketpair:FD": one end of a socketpair created by the program that
+//   started both sides, given as file descriptor FD.
+//   "pipe:RFD,WFD": two pipes created by the program that started both sides,
+//   read from file descriptor RFD and written to WFD.
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+// Open port with the transport of its prefix, or as a serial port with the
+// baud rate.
+// Returns the file descriptor to wait for bytes, -1 on error.
+int transportOpen(const char *port, int baudRate);
+
+// Close the transport opened by transportOpen.
+// Returns -1 on error.
+int transportClose();
+
+// Read up to numBytes of the bytes available.
+// Returns -1 on error, otherwise the number of bytes read (0 if none).
+int transportRead(unsigned char *bytes, int numBytes);
+
+// Write numBytes (up to numBytes with a serial port).
+// Returns -1 on error, otherwise the number of bytes written.
+int transportWrite(const unsigned char *bytes, int numBytes);
+
+// Wait until the bytes written have left the line.
+// Returns -1 on error.
+int transportDrain();
+
+// Returns 1 if the other side closed its end of the stream (a socketpair, the
+// pipes or a pty), which can't come back like an unplugged cable, 0 otherwise.
+int transportClosed();
+
+#endif // _TRANSPORT_H_
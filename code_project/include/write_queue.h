@@ -0,0 +1,61 @@
+// Write queue header.
+
+#ifndef _WRITE_QUEUE_H_
+#define _WRITE_QUEUE_H_
+
+#include <stdatomic.h>
+
+// A block of data in the queue and where it goes.
+typedef struct
+{
+    long offset; // Position in the file
+    int size;
+    int tag; // Given by the producer (like a checkpoint to save after the write)
+} WriteBlock;
+
+// Bounded queue of blocks of at most blockSize bytes, with one producer and
+// one consumer. The producer only moves the tail and the consumer only the
+// head, so neither takes a lock and a block only costs the atomic loads and
+// stores. A side that finds the queue full (or empty) spins for a while, then
+// sleeps on a futex of the head (or tail), and the other side only makes the
+// system call to wake it when its waiting flag is set.
+typedef struct
+{
+    unsigned char *data; // slots * blockSize bytes
+    WriteBlock *blocks;
+    int slots;
+    int blockSize;
+    atomic_uint head; // Blocks taken by the consumer, modulo 2 * slots (a futex word)
+    atomic_uint tail; // Blocks given by the producer, modulo 2 * slots (a futex word)
+    atomic_int producerWaiting; // Sleeping (or about to) on the head
+    atomic_int consumerWaiting; // Sleeping (or about to) on the tail
+
+    // Statistics, updated by the producer
+    int maxDepth;
+    long long depthSum;
+    int pushes;
+    int fullWaits; // Times the producer found the queue full
+} WriteQueue;
+
+// Create a queue of slots blocks of blockSize bytes.
+// Returns -1 on error.
+int writeQueueInit(WriteQueue *queue, int slots, int blockSize);
+
+// Free the memory of the queue.
+void writeQueueFree(WriteQueue *queue);
+
+// Producer: wait for a free slot and return its buffer (blockSize bytes).
+unsigned char *writeQueueReserve(WriteQueue *queue);
+
+// Producer: give the block written in the buffer of writeQueueReserve to the
+// consumer.
+void writeQueuePush(WriteQueue *queue, long offset, int size, int tag);
+
+// Consumer: wait for the oldest block, fill block and return its data. The
+// slot stays in use until writeQueuePop.
+const unsigned char *writeQueuePeek(WriteQueue *queue, WriteBlock *block);
+
+// Consumer: give the slot of the block of writeQueuePeek back to the producer.
+void writeQueuePop(WriteQueue *queue);
+
+#endif // _WRITE_QUEUE_H_
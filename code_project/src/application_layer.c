@@ -1,23 +1,170 @@
 // Application layer protocol implementation
 
 #include "application_layer.h"
-#include "link_layer.h"
+#include "link_layer_ext.h"
+#include "compress.h"
+#include "fcs.h"
+#include "write_queue.h"
+#include "file_output.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//bytes of a data packet that aren't file data (the 4 byte header and the terminator)
+#define DATA_PACKET_OVERHEAD 5
+
+//data packets carry the sequence number modulo this value
+#define DATA_SEQ_MODULUS 100
+
+//compression of the data packets: with COMPRESSION=1 the transmitter announces COMPRESS_LZ in the start packet and
+//tries to compress each chunk of the file. A chunk that gets smaller goes in a compressed data packet
+//(C=4, with the size of the original data after L2 L1), the others (like penguin.gif) go in normal data packets.
+//Both sides keep the chunks already sent as history, so a chunk can refer to the ones before it
+#ifndef COMPRESSION
+#define COMPRESSION 0
+#endif
+#define COMPRESSED_PACKET_OVERHEAD 7
+
+static CompressStream compress_stream;
+static unsigned char compressed_chunk[COMPRESS_MAX_CHUNK]; //transmitter, compressed data of the last chunk
+
+//memory mapped file I/O: with MMAP_IO=1 the transmitter maps the file and builds the data packets from the mapping,
+//and the receiver creates the file with the size of the start packet, maps it and writes the data at its place in
+//the mapping. There are no stdio buffers and no read or write system calls for the data
+#ifndef MMAP_IO
+#define MMAP_IO 0
+#endif
+
+//batch transfers: when the file given to the transmitter is a directory (every regular file in it, in name order) or a
+//manifest (@list, one path per line), each file is sent with its start, data and end packets in the same connection.
+//The receiver writes them in the directory it was given, with the names of the start packets
+static char **batch_paths = NULL;
+static int batch_length = 0;
+
+//resumable transfers: with RESUME=1 the receiver keeps a checkpoint next to its output (<output>.ckpt) with the size
+//of the file being received, the bytes already written, a hash of its name, the last sequence number and the name.
+//In llopen it gives the checkpoint to the transmitter, that continues from that file (the ones before it are complete)
+//and announces the offset in the start packet. The checkpoint is saved every CHECKPOINT_INTERVAL bytes and at the end
+//of each file, and removed when the connection is closed
+#ifndef RESUME
+#define RESUME 0
+#endif
+#define CHECKPOINT_SIZE 13 //file size, bytes written and name hash (4 bytes each, least significant first), sequence
+#define CHECKPOINT_INTERVAL 8192
+
+static unsigned char checkpoint[CHECKPOINT_SIZE];
+static char *checkpoint_name = NULL;
+static int checkpoint_fd = -1;
+
+//file mapped in memory (MMAP_IO)
+static unsigned char *file_map = NULL;
+static long file_map_size = 0;
+static int file_map_fd = -1;
+
+//asynchronous writes: with WRITE_QUEUE_DEPTH > 0 the receiver copies the data of each packet to a queue of that many
+//blocks and goes back to the serial port, and a writer thread writes the blocks in the file. The writer also saves the
+//checkpoints, after the data they count was written. A slow disk only fills the queue. The writer thread doesn't exit
+//when a write fails: it stops writing, keeps taking the blocks and tells the receiver, which closes the link
+#ifndef WRITE_QUEUE_DEPTH
+#define WRITE_QUEUE_DEPTH 0
+#endif
+#define WRITE_CHECKPOINT 0x100 //tags of the blocks: the sequence number of the packet, plus this to save a checkpoint
+                               //after the write
+#define WRITE_SYNC -2 //the writer posts write_synced when it gets here
+#define WRITE_STOP -3
+
+static WriteQueue write_queue;
+static pthread_t writer_thread;
+static sem_t write_synced;
+static atomic_bool writer_failed; //a write or a checkpoint of the writer thread failed, with writer_error
+static int writer_error = 0;
+
+//coalesced output: with OUTPUT_BACKEND=OUTPUT_PWRITE or OUTPUT_URING the receiver gathers the data of the packets in
+//big aligned buffers (file_output.c) and writes each full buffer with one pwrite, or submits it to an io_uring and
+//fills the next buffer while the kernel writes it. With OUTPUT_DIRECT=1 the file is opened with O_DIRECT, when the
+//file system supports it, so the data doesn't go through the page cache. OUTPUT_STDIO writes each packet with stdio
+#ifndef OUTPUT_BACKEND
+#define OUTPUT_BACKEND OUTPUT_STDIO
+#endif
+#ifndef OUTPUT_DIRECT
+#define OUTPUT_DIRECT 0
+#endif
+#if OUTPUT_BACKEND != OUTPUT_STDIO && MMAP_IO
+#error "MMAP_IO writes the received file through the mapping, it can't be used with OUTPUT_BACKEND"
+#endif
+
+//when the receiver syncs the data to the disk, for each file: FSYNC_NONE leaves it to the kernel, FSYNC_END syncs the
+//file when it is complete and FSYNC_CHECKPOINT also syncs the data and the checkpoint each time a checkpoint is saved,
+//so the checkpoint never counts data that a power loss can take
+#define FSYNC_NONE 0
+#define FSYNC_END 1
+#define FSYNC_CHECKPOINT 2
+#ifndef FSYNC_POLICY
+#define FSYNC_POLICY FSYNC_NONE
+#endif
+
+//data packets written in the coalesced output (OUTPUT_BACKEND), where each one ends and its sequence number. Its
+//checkpoints count the newest packet inside the whole blocks written, so that the sequence number matches the bytes
+#define WRITTEN_PACKETS 64
+static long written_end[WRITTEN_PACKETS];
+static int written_sequence[WRITTEN_PACKETS];
+static int written_count = 0;
+
+//file being received, used by the writer thread
+static FILE *receive_file = NULL;
+static FileOutput receive_output;
+static int receive_size = 0;
+static const char *receive_name = NULL;
+
+//used for the statistics
+static long long file_bytes = 0; //file data sent or received
+static long long data_bytes = 0; //data in the data packets, after the compression
+static int data_packets = 0;
+static int compressed_packets = 0;
+static long long output_writes = 0; //writes of the coalesced output (OUTPUT_BACKEND)
+static long long output_bytes = 0;
+static const char *output_name = NULL;
+
+//current time in seconds, to measure the goodput
+double currentTime(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
 
-//Creates a control packet to send
-unsigned char * createControlPacket(int c, const char *filename, int file_size, int *packet_size){
+//Creates a control packet to send. A start packet of a transfer that continues a previous one has the resume offset
+unsigned char * createControlPacket(int c, const char *filename, int file_size, int resume_offset, int *packet_size){
 
-    int numb_Bytes = (log2(file_size) / 8) + 1; //number of octets (bytes) used in V1
+    //number of octets (bytes) used in V1, at least one (an empty file of a batch has size 0)
+    int numb_Bytes = 1;
+    while(numb_Bytes < (int) sizeof(file_size) && (file_size >> (8 * numb_Bytes)) != 0){
+        numb_Bytes++;
+    }
     unsigned char L1 = (unsigned char) numb_Bytes;
 
     unsigned char L2 = (unsigned char) strlen(filename);
     *packet_size = L2 + L1 + 5;
+    if(COMPRESSION){
+        *packet_size += 3;
+    }
+    if(resume_offset > 0){
+        *packet_size += 6;
+    }
 
-    unsigned char * packet = (unsigned char*)malloc(sizeof(unsigned char) * *packet_size);
+    //one more byte for the terminator
+    unsigned char * packet = (unsigned char*)malloc(sizeof(unsigned char) * (*packet_size + 1));
 
     packet[0] = c;
     packet[1] = 0; //first send the file size
@@ -35,6 +182,21 @@ unsigned char * createControlPacket(int c, const char *filename, int file_size,
     packet[packet_idx++] = 1; //file name
     packet[packet_idx++] = L2;
     memcpy(&packet[packet_idx], filename, L2);
+    packet_idx += L2;
+
+    if(COMPRESSION){
+        packet[packet_idx++] = 2; //compression of the data packets
+        packet[packet_idx++] = 1;
+        packet[packet_idx++] = COMPRESS_LZ;
+    }
+
+    if(resume_offset > 0){
+        packet[packet_idx++] = 3; //resume offset
+        packet[packet_idx++] = 4;
+        for(int i = 0; i < 4; i++){
+            packet[packet_idx++] = (resume_offset >> (8 * i)) & 0xFF;
+        }
+    }
 
     packet[*packet_size] = '\0';
     *packet_size += 1;
@@ -42,14 +204,10 @@ unsigned char * createControlPacket(int c, const char *filename, int file_size,
     return packet;
 }
 
-//creates a data packet to send
-unsigned char * createDataPacket(int seq, unsigned char *data, int data_size, int *packet_size){
-    *packet_size = 4 + data_size; //four first bytes plus the data bytes
-
-    unsigned char *packet = (unsigned char*)malloc(sizeof(unsigned char) * *packet_size);
-
+//writes the header of a data packet in front of the data_size bytes of data already in packet[4]. Returns the packet size
+int createDataPacket(unsigned char *packet, int seq, int data_size){
     packet[0] = 2; //sending data;
-    packet[1] = (unsigned int) seq % 100;
+    packet[1] = (unsigned int) seq % DATA_SEQ_MODULUS;
     
     // data_size = (256 * L2 + L1)
     unsigned char L2 = data_size >> 8 & 0xFF;
@@ -57,34 +215,59 @@ unsigned char * createDataPacket(int seq, unsigned char *data, int data_size, in
     packet[2] = L2;
     packet[3] = L1;
 
-    //copy the data to the packet
-    memcpy(&packet[4], data, data_size );
-
-    packet[*packet_size] = '\0';
-    *packet_size += 1;
+    packet[4 + data_size] = '\0';
+    return 4 + data_size + 1;
+}
 
-    return packet;
+//writes the header of a compressed data packet in front of the compressed_size bytes already in packet[6], that
+//decompress into data_size bytes. Returns the packet size
+int createCompressedPacket(unsigned char *packet, int seq, int compressed_size, int data_size){
+    packet[0] = 4; //sending compressed data
+    packet[1] = (unsigned int) seq % DATA_SEQ_MODULUS;
+    packet[2] = compressed_size >> 8 & 0xFF;
+    packet[3] = compressed_size & 0xFF;
+    packet[4] = data_size >> 8 & 0xFF;
+    packet[5] = data_size & 0xFF;
+
+    packet[6 + compressed_size] = '\0';
+    return 6 + compressed_size + 1;
 }
 
-//process a data packet by getting the needed info from it
-void processDataPacket(unsigned char *packet, int *seq, unsigned char *data, int *data_size){
+//process a data packet of packet_size bytes by getting the needed info from it. Returns where the data starts inside
+//the packet, or NULL if the size in the header doesn't fit in the packet
+const unsigned char *processDataPacket(const unsigned char *packet, int packet_size, int *seq, int *data_size){
     //sequence byte
     *seq = packet[1];
 
-    //get the size of the data
+    //get the size of the data. Each packet can have a different size (the link layer chooses it)
     unsigned char L2 = packet[2];
     unsigned char L1 = packet[3];
     *data_size = (L2 << 8) | L1;
+    if(*data_size > packet_size - DATA_PACKET_OVERHEAD){
+        return NULL;
+    }
 
-    //copy the data from the packet to the received data buffer
-    memcpy(data, &packet[4], *data_size);
+    return &packet[4];
+}
 
-    packet[*data_size + 4] = '\0';
+//process a compressed data packet of packet_size bytes and decompresses its data into the history. Returns the
+//decompressed data, or NULL if the packet is malformed
+const unsigned char *processCompressedPacket(const unsigned char *packet, int packet_size, int *seq, int *data_size){
+    *seq = packet[1];
+
+    int compressed_size = (packet[2] << 8) | packet[3];
+    int original_size = (packet[4] << 8) | packet[5];
+    if(compressed_size > packet_size - COMPRESSED_PACKET_OVERHEAD){
+        return NULL;
+    }
 
+    *data_size = original_size;
+    return decompressStreamChunk(&compress_stream, &packet[6], compressed_size, original_size);
 }
 
-//process a control packet by getting the needed info from it
-void processControlPacket(unsigned char* packet,  char *filename, int *file_size, int packet_size){
+//process a control packet of packet_size bytes by getting the needed info from it
+void processControlPacket(const unsigned char* packet, int packet_size, char *filename, int *file_size, int *compression,
+                          int *resume_offset){
 
     int L1 = packet[2];
 
@@ -106,167 +289,807 @@ void processControlPacket(unsigned char* packet,  char *filename, int *file_size
 
     filename[L2] = '\0';
 
-    packet[packet_size] = '\0';
+    //optional parameters after the file name (the last byte is the terminator)
+    *compression = COMPRESS_NONE;
+    *resume_offset = 0;
+    int i = 3 + L1 + 2 + L2;
+    while(i + 2 < packet_size && i + 2 + packet[i + 1] < packet_size){
+        int length = packet[i + 1];
+        if(packet[i] == 2 && length == 1){
+            *compression = packet[i + 2];
+        }
+        else if(packet[i] == 3 && length == 4){
+            *resume_offset = packet[i + 2] | (packet[i + 3] << 8) | (packet[i + 4] << 16) | (packet[i + 5] << 24);
+        }
+        i += 2 + length;
+    }
 }
 
-void applicationLayer(const char *serialPort, const char *role, int baudRate,
-                      int nTries, int timeout, const char *filename)
-{
-    LinkLayer connectionParameters;
-    connectionParameters.baudRate = baudRate;
-    connectionParameters.nRetransmissions = nTries; 
-    connectionParameters.role = strcmp(role, "tx") ? LlRx : LlTx;
-    strcpy(connectionParameters.serialPort,serialPort);
-    connectionParameters.timeout = timeout;
+//reads a 4 byte value, least significant byte first
+int getValue(const unsigned char *bytes){
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
+}
 
-    if(llopen(connectionParameters) < 0){
-        perror("Error in the connection\n");
-        exit(-1);
+void putValue(unsigned char *bytes, int value){
+    for(int i = 0; i < 4; i++){
+        bytes[i] = (value >> (8 * i)) & 0xFF;
     }
+}
 
-    //some variables used in the switch
-    FILE *file;
-    FILE* newFile;
-    unsigned char *packet_RC;
-    char *fname;
-    char *name_end;
-    unsigned char *content_received;
+//hash of the name of the file, so a checkpoint is only used for the same file
+int nameHash(const char *name){
+    return (int)(crc32cUpdate(0xFFFFFFFF, (const unsigned char *) name, strlen(name)) ^ 0xFFFFFFFF);
+}
+
+//name of a file without the directories of its path
+const char *baseName(const char *path){
+    const char *slash = strrchr(path, '/');
+    return slash == NULL ? path : slash + 1;
+}
+
+bool isDirectory(const char *path){
+    struct stat info;
+    return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+//where the receiver writes the file with this name: inside the directory it was given (only the name, a start packet
+//can't write outside of it) or the file it was given. Returns NULL if the name can't be used
+char *outputPath(const char *output, const char *name){
+    if(!isDirectory(output)){
+        return strdup(output);
+    }
+
+    name = baseName(name);
+    if(name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0){
+        return NULL;
+    }
+    char *path = (char*)malloc(strlen(output) + strlen(name) + 2);
+    sprintf(path, "%s/%s", output, name);
+    return path;
+}
+
+//reads the checkpoint of the receiver into checkpoint. Returns its size, 0 if there is none or if the file doesn't
+//have the bytes that it says were written
+int loadCheckpoint(const char *output){
+    checkpoint_name = (char*)malloc(strlen(output) + 6);
+    sprintf(checkpoint_name, "%s.ckpt", output);
+
+    int fd = open(checkpoint_name, O_RDONLY);
+    if(fd < 0){
+        return 0;
+    }
+    unsigned char record[CHECKPOINT_SIZE + 256];
+    int size = read(fd, record, sizeof(record));
+    close(fd);
+    if(size < CHECKPOINT_SIZE + 1 || size < CHECKPOINT_SIZE + 1 + record[CHECKPOINT_SIZE]){
+        return 0;
+    }
+    memcpy(checkpoint, record, CHECKPOINT_SIZE);
+
+    char name[256];
+    memcpy(name, &record[CHECKPOINT_SIZE + 1], record[CHECKPOINT_SIZE]);
+    name[record[CHECKPOINT_SIZE]] = '\0';
+
+    struct stat info;
+    char *path = outputPath(output, name);
+    bool written = path != NULL && stat(path, &info) == 0 && info.st_size >= getValue(&checkpoint[4]);
+    free(path);
+    return written ? CHECKPOINT_SIZE : 0;
+}
+
+//saves the bytes of the file already written and the last sequence number in the checkpoint
+void saveCheckpoint(int file_size, const char *name, int bytes_written, int sequence){
+    if(checkpoint_fd < 0){
+        checkpoint_fd = open(checkpoint_name, O_WRONLY | O_CREAT, 0644);
+        if(checkpoint_fd < 0){
+            return;
+        }
+    }
+    putValue(&checkpoint[0], file_size);
+    putValue(&checkpoint[4], bytes_written);
+    putValue(&checkpoint[8], nameHash(name));
+    checkpoint[12] = sequence;
+
+    //the name (after its size) is only kept in the file, to find the file being received
+    unsigned char record[CHECKPOINT_SIZE + 256];
+    int length = strlen(name) > 255 ? 255 : strlen(name);
+    memcpy(record, checkpoint, CHECKPOINT_SIZE);
+    record[CHECKPOINT_SIZE] = length;
+    memcpy(&record[CHECKPOINT_SIZE + 1], name, length);
+    pwrite(checkpoint_fd, record, CHECKPOINT_SIZE + 1 + length, 0);
+    if(FSYNC_POLICY == FSYNC_CHECKPOINT){
+        fdatasync(checkpoint_fd);
+    }
+}
+
+//the transfer is complete, the checkpoint isn't needed
+void removeCheckpoint(){
+    if(checkpoint_fd >= 0){
+        close(checkpoint_fd);
+        checkpoint_fd = -1;
+    }
+    unlink(checkpoint_name);
+    free(checkpoint_name);
+}
+
+//opens and maps the file to send. Returns its size or -1 on error
+long mapInputFile(const char *filename){
+    file_map_fd = open(filename, O_RDONLY);
+    if(file_map_fd < 0){
+        return -1;
+    }
+
+    struct stat info;
+    if(fstat(file_map_fd, &info) < 0){
+        return -1;
+    }
+    file_map_size = info.st_size;
+
+    //an empty file has nothing to map
+    if(file_map_size > 0){
+        file_map = mmap(NULL, file_map_size, PROT_READ, MAP_PRIVATE, file_map_fd, 0);
+        if(file_map == MAP_FAILED){
+            file_map = NULL;
+            return -1;
+        }
+        madvise(file_map, file_map_size, MADV_SEQUENTIAL);
+    }
+    return file_map_size;
+}
+
+//creates the file to receive with file_size bytes (allocated now, so the disk can't get full while writing in the
+//mapping) and maps it. A resumed transfer keeps the data already in the file. Returns 0 or -1 on error
+int mapOutputFile(const char *filename, long file_size, int resume){
+    file_map_fd = open(filename, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+    if(file_map_fd < 0){
+        return -1;
+    }
+
+    file_map_size = file_size;
+    if(file_map_size > 0){
+        if(posix_fallocate(file_map_fd, 0, file_map_size) != 0){
+            return -1;
+        }
+        file_map = mmap(NULL, file_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, file_map_fd, 0);
+        if(file_map == MAP_FAILED){
+            file_map = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void unmapFile(){
+    if(file_map != NULL){
+        munmap(file_map, file_map_size);
+        file_map = NULL;
+    }
+    close(file_map_fd);
+    file_map_fd = -1;
+}
+
+int compareNames(const void *a, const void *b){
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+void addBatchFile(const char *path){
+    batch_paths = (char**)realloc(batch_paths, sizeof(char*) * (batch_length + 1));
+    batch_paths[batch_length++] = strdup(path);
+}
+
+//fills the list of files to send: the file itself, the regular files of a directory or the files of a manifest.
+//Returns how many there are
+int listFiles(const char *filename){
+    if(filename[0] == '@'){
+        FILE *manifest = fopen(filename + 1, "r");
+        if(manifest == NULL){
+            return 0;
+        }
+        char line[4096];
+        while(fgets(line, sizeof(line), manifest) != NULL){
+            line[strcspn(line, "\r\n")] = '\0';
+            if(line[0] != '\0'){
+                addBatchFile(line);
+            }
+        }
+        fclose(manifest);
+    }
+    else if(isDirectory(filename)){
+        DIR *dir = opendir(filename);
+        if(dir == NULL){
+            return 0;
+        }
+        struct dirent *entry;
+        while((entry = readdir(dir)) != NULL){
+            char *path = (char*)malloc(strlen(filename) + strlen(entry->d_name) + 2);
+            sprintf(path, "%s/%s", filename, entry->d_name);
+            struct stat info;
+            if(stat(path, &info) == 0 && S_ISREG(info.st_mode)){
+                addBatchFile(path);
+            }
+            free(path);
+        }
+        closedir(dir);
+        qsort(batch_paths, batch_length, sizeof(char*), compareNames);
+    }
+    else{
+        addBatchFile(filename);
+    }
+    return batch_length;
+}
+
+//sends the file in path with its start, data and end packets, from resume_offset on
+void sendFile(const char *path, int resume_offset, int sequence){
+    FILE *file = NULL;
     unsigned char *controlPacket;
-    unsigned char *content;
     unsigned char *packet;
+    const char *name = baseName(path);
 
-    switch(connectionParameters.role){
-        case LlTx:
-
-        file = fopen(filename, "r");
+    int file_size = 0;
+    if(MMAP_IO){
+        file_size = (int) mapInputFile(path);
+        if(file_size < 0){
+            perror("The file doesn't exist or can't be mapped\n");
+            exit(-1);
+        }
+    }
+    else{
+        file = fopen(path, "r");
         if(file == NULL){
             perror("The file doesn't exist\n");
             exit(-1);
         }
 
-
         //get the file size
         fseek(file, 0L, SEEK_END);
-        int file_size = (int) ftell(file);
+        file_size = (int) ftell(file);
         rewind(file);
+    }
 
+    //continues the transfer of the file from the bytes the receiver already has
+    if(resume_offset > 0){
+        if(!MMAP_IO){
+            fseek(file, resume_offset, SEEK_SET);
+        }
+        printf("Resuming the transfer of %s at byte %d\n", name, resume_offset);
+    }
 
-        //create the Start packet
-        int packet_size = 0;
-        controlPacket = createControlPacket(1, filename, file_size, &packet_size);
+    //create the Start packet
+    int packet_size = 0;
+    controlPacket = createControlPacket(1, name, file_size, resume_offset, &packet_size);
 
-        //send the start packet
-        if(llwrite(controlPacket, packet_size) < 0){
-            printf("Error while writing the start packet\n");
+    //send the start packet
+    if(llwrite(controlPacket, packet_size) < 0){
+        printf("Error while writing the start packet\n");
+        exit(-1);
+    }
+
+    free(controlPacket);
+
+    int bytes_left = file_size - resume_offset;
+    //send data packets (with the payload size chosen by the link layer, it can change after each packet).
+    //The file is read (or copied from the mapping) straight into the frame of the link layer, after the space
+    //of the packet header
+    while(bytes_left > 0){
+        int payload = llpayloadsize();
+        packet = llreserve(payload);
+        if(packet == NULL){
+            printf("Error while reserving a data packet\n");
             exit(-1);
         }
 
-        free(controlPacket);
+        int bytes_read = payload - DATA_PACKET_OVERHEAD;
+        if(MMAP_IO){
+            bytes_read = bytes_left < bytes_read ? bytes_left : bytes_read;
+            memcpy(packet + 4, file_map + (file_size - bytes_left), bytes_read);
+        }
+        else{
+            bytes_read = fread(packet + 4, sizeof(unsigned char) , bytes_read, file);
+        }
+        packet_size = createDataPacket(packet, sequence, bytes_read);
+        int data_size = bytes_read;
+
+        //sends the chunk compressed only if the packet gets smaller. The test stops as soon as it can't
+        if(COMPRESSION){
+            memcpy(compressStreamNext(&compress_stream, bytes_read), packet + 4, bytes_read);
+            int compressed = compressStreamChunk(&compress_stream, compressed_chunk, bytes_read - 3, bytes_read);
+            if(compressed > 0){
+                memcpy(packet + 6, compressed_chunk, compressed);
+                packet_size = createCompressedPacket(packet, sequence, compressed, bytes_read);
+                data_size = compressed;
+                compressed_packets++;
+            }
+        }
+        file_bytes += bytes_read;
+        data_bytes += data_size;
+        data_packets++;
 
-        int bytes_left = file_size;
-        int sequence = 0;
-        content = (unsigned char*)malloc(sizeof(unsigned char) * MAX_PAYLOAD_SIZE);
-        //send data packets (1000 bytes at time)
-        while(bytes_left > 0){
-            int bytes_read = fread(content, sizeof(unsigned char) , MAX_PAYLOAD_SIZE - 5, file);
+        if(llcommit(packet_size) < 0){
+            printf("Error while writing a data packet\n");
+            exit(-1);
+        }
 
-            packet = createDataPacket(sequence, content, bytes_read, &packet_size);
+        bytes_left -= bytes_read;
+        sequence++;
+    }
 
-            if(llwrite(packet,packet_size) < 0){
-                printf("Error while writing a data packet\n");
-                exit(-1);
-            }
 
-            free(packet);
+    //create the end packet
+    controlPacket = createControlPacket(3, name, file_size, 0, &packet_size);
+
+    //send the end packet
+    if(llwrite(controlPacket, packet_size) < 0){
+        printf("Error while writing the end packet\n");
+        exit(-1);
+    }
 
-            bytes_left -= bytes_read;
-            sequence++;
+    free(controlPacket);
+    if(MMAP_IO){
+        unmapFile();
+    }
+    else{
+        fclose(file);
+    }
+}
+
+//writes size bytes of data of the packet with sequence at offset of the file being received. Returns -1 on error
+//(with errno)
+int writeData(long offset, const unsigned char *data, int size, int sequence){
+    if(MMAP_IO){
+        memcpy(file_map + offset, data, size);
+    }
+    else if(OUTPUT_BACKEND != OUTPUT_STDIO){
+        if(outputWrite(&receive_output, offset, data, size) < 0){
+            return -1;
         }
+        written_end[written_count % WRITTEN_PACKETS] = offset + size;
+        written_sequence[written_count % WRITTEN_PACKETS] = sequence;
+        written_count++;
+    }
+    else if(fseek(receive_file, offset, SEEK_SET) < 0 ||
+            (int) fwrite(data, sizeof(unsigned char), size, receive_file) != size){
+        return -1;
+    }
+    return 0;
+}
 
+//gives the data written to the kernel, and syncs it to the disk if durable. Returns -1 on error (with errno)
+int syncOutput(bool durable){
+    int result = 0;
+    if(MMAP_IO){
+        if(durable){
+            result = msync(file_map, file_map_size, MS_SYNC);
+        }
+    }
+    else if(OUTPUT_BACKEND != OUTPUT_STDIO){
+        result = outputSync(&receive_output, durable);
+    }
+    else{
+        result = fflush(receive_file);
+        if(durable && result == 0){
+            result = fdatasync(fileno(receive_file));
+        }
+    }
+    return result < 0 ? -1 : 0;
+}
 
-        //create the end packet
-        controlPacket = createControlPacket(3, filename, file_size, &packet_size);
+//closes the file being received, synced to the disk unless the policy is FSYNC_NONE
+void closeOutput(){
+    bool durable = FSYNC_POLICY != FSYNC_NONE;
+    if(OUTPUT_BACKEND != OUTPUT_STDIO){
+        int result = outputClose(&receive_output, durable);
+        output_name = outputName(&receive_output);
+        output_writes += receive_output.writes;
+        output_bytes += receive_output.bytes;
+        if(result < 0){
+            perror("Error while writing the file\n");
+            exit(-1);
+        }
+        return;
+    }
+
+    if(syncOutput(durable) < 0){
+        perror("Error while writing the file\n");
+        exit(-1);
+    }
+    if(MMAP_IO){
+        unmapFile();
+    }
+    else{
+        fclose(receive_file);
+    }
+}
+
+//saves the checkpoint of the file being received. The data is given to the kernel before the checkpoint says that it
+//was written, a checkpoint isn't saved if it can't be. The coalesced output only writes its whole blocks, the
+//checkpoint counts the packets inside them and the rest is received again after a resume. Without such a packet
+//among the ones kept, the last checkpoint stays. Returns -1 on error (with errno)
+int commitCheckpoint(long bytes_written, int sequence){
+    if(OUTPUT_BACKEND != OUTPUT_STDIO){
+        long written = outputCheckpoint(&receive_output, FSYNC_POLICY == FSYNC_CHECKPOINT);
+        if(written < 0){
+            return -1;
+        }
+        int i = written_count - 1;
+        while(i >= 0 && i >= written_count - WRITTEN_PACKETS && written_end[i % WRITTEN_PACKETS] > written){
+            i--;
+        }
+        if(i < 0 || i < written_count - WRITTEN_PACKETS){
+            return 0;
+        }
+        bytes_written = written_end[i % WRITTEN_PACKETS];
+        sequence = written_sequence[i % WRITTEN_PACKETS];
+    }
+    else if((!MMAP_IO || FSYNC_POLICY == FSYNC_CHECKPOINT) && syncOutput(FSYNC_POLICY == FSYNC_CHECKPOINT) < 0){
+        return -1;
+    }
+    saveCheckpoint(receive_size, receive_name, bytes_written, sequence);
+    return 0;
+}
+
+//writer thread: writes the blocks of the queue in the file being received, in order. After an error it only takes
+//the blocks, so the receiver never waits for a full queue, and the checkpoint stays at the last data written
+void *writerThread(void *arg){
+    while(TRUE){
+        WriteBlock block;
+        const unsigned char *data = writeQueuePeek(&write_queue, &block);
+        if(block.tag == WRITE_STOP){
+            writeQueuePop(&write_queue);
+            return NULL;
+        }
 
-        //send the start packet
-        if(llwrite(controlPacket, packet_size) < 0){
-            printf("Error while writing the end packet\n");
+        if(block.tag == WRITE_SYNC){
+            sem_post(&write_synced);
+        }
+        else if(!atomic_load(&writer_failed)){
+            int sequence = block.tag & ~WRITE_CHECKPOINT;
+            if(writeData(block.offset, data, block.size, sequence) < 0 ||
+               ((block.tag & WRITE_CHECKPOINT) && commitCheckpoint(block.offset + block.size, sequence) < 0)){
+                writer_error = errno;
+                atomic_store(&writer_failed, true);
+            }
+        }
+        writeQueuePop(&write_queue);
+    }
+}
+
+//starts the writer thread and its queue. Returns -1 on error
+int startWriter(){
+    atomic_init(&writer_failed, false);
+    if(writeQueueInit(&write_queue, WRITE_QUEUE_DEPTH, COMPRESS_MAX_CHUNK) < 0){
+        return -1;
+    }
+    if(sem_init(&write_synced, 0, 0) < 0){
+        writeQueueFree(&write_queue);
+        return -1;
+    }
+    if(pthread_create(&writer_thread, NULL, writerThread, NULL) != 0){
+        sem_destroy(&write_synced);
+        writeQueueFree(&write_queue);
+        return -1;
+    }
+    return 0;
+}
+
+//stops the writer thread once it took every block of the queue, and frees the queue (its statistics stay)
+void stopWriter(){
+    writeQueueReserve(&write_queue);
+    writeQueuePush(&write_queue, 0, 0, WRITE_STOP);
+    pthread_join(writer_thread, NULL);
+    sem_destroy(&write_synced);
+    writeQueueFree(&write_queue);
+}
+
+//the data couldn't be written: closes the file and the link, and exits. The checkpoint (RESUME) keeps the data that
+//was written, so the transfer can continue from there
+void failWrite(int error){
+    errno = error;
+    perror("Error while writing the file\n");
+    if(WRITE_QUEUE_DEPTH > 0){
+        stopWriter();
+    }
+    if(OUTPUT_BACKEND != OUTPUT_STDIO){
+        outputClose(&receive_output, false);
+    }
+    else if(MMAP_IO){
+        unmapFile();
+    }
+    else{
+        fclose(receive_file);
+    }
+    llclose(FALSE);
+    exit(-1);
+}
+
+//closes the link if the writer thread failed to write the blocks it took
+void checkWriter(){
+    if(WRITE_QUEUE_DEPTH > 0 && atomic_load(&writer_failed)){
+        failWrite(writer_error);
+    }
+}
+
+//waits until the writer thread wrote every block already in the queue
+void syncWriter(){
+    if(WRITE_QUEUE_DEPTH > 0){
+        writeQueueReserve(&write_queue);
+        writeQueuePush(&write_queue, 0, 0, WRITE_SYNC);
+        while(sem_wait(&write_synced) != 0);
+        checkWriter();
+    }
+}
+
+//receives a file (start, data and end packets) and writes it in output, or inside output if it is a directory.
+//Returns 1 when the file was received or 0 if the transmitter closed the connection instead of starting another file
+int receiveFile(const char *output, int files_received, int *compression){
+    const unsigned char *packet_RC;
+    const unsigned char *data_RC;
+    char *fname;
+    char *name_end;
+    int resume_offset = 0;
+
+    //read the start packet from the serial port. The packets are read in place, inside the link layer
+    int packet_size_RC = -1;
+    while ((packet_size_RC = llreadview(&packet_RC)) < 0);
+    if(packet_size_RC == 0){
+        return 0;
+    }
+    if(packet_RC[0] != 1){
+        printf("Expected Start control packet but received another\n");
+        exit(-1);
+    }
+
+    //process the start packet
+    int file_size_RC = 0;
+    fname = (char*)malloc(sizeof(unsigned char) * MAX_PAYLOAD_SIZE);
+    if(fname == NULL){
+        printf("problem with allocation\n");
+    }
+    processControlPacket(packet_RC, packet_size_RC, fname, &file_size_RC, compression, &resume_offset);
+    if(*compression != COMPRESS_NONE && *compression != COMPRESS_LZ){
+        printf("Unknown compression of the data packets\n");
+        exit(-1);
+    }
+
+    //more than one file only fits in a directory
+    if(files_received > 0 && !isDirectory(output)){
+        printf("The transmitter is sending several files, the receiver needs a directory to write them\n");
+        exit(-1);
+    }
+    char *path = outputPath(output, fname);
+    if(path == NULL){
+        printf("The name of the file in the start packet can't be used\n");
+        exit(-1);
+    }
+
+    //the transmitter only resumes from the checkpoint that this receiver gave it
+    if(resume_offset > 0){
+        if(!RESUME || files_received > 0 || getValue(&checkpoint[0]) != file_size_RC ||
+           getValue(&checkpoint[4]) != resume_offset || getValue(&checkpoint[8]) != nameHash(fname)){
+            printf("The transmitter resumes from a place that isn't in the checkpoint\n");
             exit(-1);
         }
+        printf("Resuming the transfer of %s at byte %d\n", fname, resume_offset);
+    }
 
-        free(controlPacket);
-        fclose(file);
-        break;
+    //read the data
+    int sequence_RC = 0;
+    long file_offset_RC = resume_offset;
+    long checkpoint_offset_RC = resume_offset;
+    if(MMAP_IO){
+        if(mapOutputFile(path, file_size_RC, resume_offset > 0) < 0){
+            perror("Error while creating the file\n");
+            exit(-1);
+        }
+    }
+    else if(OUTPUT_BACKEND != OUTPUT_STDIO){
+        if(outputOpen(&receive_output, path, resume_offset, OUTPUT_BACKEND, OUTPUT_DIRECT) < 0){
+            perror("Error while creating the file\n");
+            exit(-1);
+        }
+    }
+    else{
+        receive_file = fopen(path, resume_offset > 0 ? "r+" : "w+");
+        if(receive_file == NULL){
+            perror("Error while creating the file\n");
+            exit(-1);
+        }
+    }
+    free(path);
+    receive_size = file_size_RC;
+    receive_name = fname;
+    written_count = 0;
+
+    while(TRUE){
+        while((packet_size_RC = llreadview(&packet_RC)) < 0);
+        if(packet_size_RC == 0){
+            printf("The connection was closed before the end packet\n");
+            syncWriter();
+            if(RESUME && commitCheckpoint(file_offset_RC, sequence_RC) < 0){
+                perror("Error while writing the file\n");
+            }
+            closeOutput();
+            exit(-1);
+        }
 
-        case LlRx:
-            //create the packet
-            packet_RC = (unsigned char *)malloc(sizeof(unsigned char) * MAX_PAYLOAD_SIZE + 1);
-
-            //read the start packet from the serial port
-            int packet_size_RC = -1;
-            while ((packet_size_RC = llread(packet_RC)) < 0);
-            if(packet_size_RC < 0){
-                printf("Error while reading the start packet\n");
+        //checks if the packet received is a end control packet
+        if(packet_RC[0] == 3){
+            name_end = (char*)malloc(sizeof(unsigned char) * MAX_PAYLOAD_SIZE);
+            int file_size_RC_end = 0;
+            int compression_end = COMPRESS_NONE;
+            int resume_end = 0;
+            processControlPacket(packet_RC, packet_size_RC, name_end, &file_size_RC_end, &compression_end,
+                                 &resume_end);
+
+            if(strcmp(fname, name_end) != 0){
+                printf("Name of the file in the start packet is different from the one in the end packet\n");
                 exit(-1);
             }
-            if(packet_RC[0] != 1){
-                printf("Expected Start control packet but received another\n");
+
+            if(file_size_RC != file_size_RC_end){
+                printf("File lenght received at the Start packet is different from the one received at the end packet\n");
                 exit(-1);
             }
 
-            //process the start packet
-            int file_size_RC = 0;
-            fname = (char*)malloc(sizeof(unsigned char) * MAX_PAYLOAD_SIZE);
-            if(fname == NULL){
-                printf("problem with allocation\n");
+            free(name_end);
+            break;
+        }
+        else{
+            //data packet received. Write the data into the file, straight from the link layer buffer (or the queue of
+            //the writer thread)
+            int data_size_RC = 0;
+            if(packet_RC[0] == 4){
+                data_RC = processCompressedPacket(packet_RC, packet_size_RC, &sequence_RC, &data_size_RC);
+                data_bytes += packet_size_RC - COMPRESSED_PACKET_OVERHEAD;
+                compressed_packets++;
             }
-            processControlPacket(packet_RC, fname, &file_size_RC, packet_size);
-
-            //read the data
-            int sequence_RC = 0;
-            newFile = fopen(filename, "w+");
-            content_received = (unsigned char*)malloc(sizeof(unsigned char) * MAX_PAYLOAD_SIZE + 2);
-            while(TRUE){
-                while((packet_size_RC = llread(packet_RC)) < 0);
-                if(packet_size_RC < 0){
-                    printf("Error while reading a data packet\n");
-                    exit(-1);
+            else{
+                data_RC = processDataPacket(packet_RC, packet_size_RC, &sequence_RC, &data_size_RC);
+                data_bytes += data_size_RC;
+
+                //the chunks sent as they are are also history of the compressed ones
+                if(data_RC != NULL && *compression == COMPRESS_LZ){
+                    memcpy(compressStreamNext(&compress_stream, data_size_RC), data_RC, data_size_RC);
+                    compressStreamCommit(&compress_stream, data_size_RC);
                 }
+            }
+            if(data_RC == NULL){
+                printf("Data packet with a wrong size\n");
+                exit(-1);
+            }
+            file_bytes += data_size_RC;
+            data_packets++;
 
-                //checks if the packet received is a end control packet
-                if(packet_RC[0] == 3){
-                    name_end = (char*)malloc(sizeof(unsigned char) * MAX_PAYLOAD_SIZE);
-                    int file_size_RC_end = 0;
-                    processControlPacket(packet_RC, name_end,&file_size_RC_end, packet_size_RC);
+            //writes the data at its place in the file instead of appending it. The packets can have
+            //different sizes, so the place is the number of bytes received before
+            if(MMAP_IO && file_offset_RC + data_size_RC > file_map_size){
+                printf("More data than the size of the file in the start packet\n");
+                exit(-1);
+            }
+            long data_end_RC = file_offset_RC + data_size_RC;
+            bool save_checkpoint = RESUME && data_end_RC - checkpoint_offset_RC >= CHECKPOINT_INTERVAL;
+            if(save_checkpoint){
+                checkpoint_offset_RC = data_end_RC;
+            }
 
-                    if(strcmp(fname, name_end) != 0){
-                        printf("Name of the file in the start packet is different from the one in the end packet\n");
-                        exit(-1);
-                    }
+            if(WRITE_QUEUE_DEPTH > 0){
+                //the writer thread writes it, the data is copied because the next packets reuse its buffer
+                memcpy(writeQueueReserve(&write_queue), data_RC, data_size_RC);
+                writeQueuePush(&write_queue, file_offset_RC, data_size_RC,
+                               save_checkpoint ? sequence_RC | WRITE_CHECKPOINT : sequence_RC);
+                checkWriter();
+            }
+            else if(writeData(file_offset_RC, data_RC, data_size_RC, sequence_RC) < 0 ||
+                    (save_checkpoint && commitCheckpoint(data_end_RC, sequence_RC) < 0)){
+                failWrite(errno);
+            }
+            file_offset_RC = data_end_RC;
+        }
+    }
 
-                    if(file_size_RC != file_size_RC_end){
-                        printf("File lenght received at the Start packet is different from the one received at the end packet\n");
-                        exit(-1);
-                    }
+    //the file is closed once the writer thread wrote all of it
+    syncWriter();
+    closeOutput();
 
-                    free(name_end);
-                    free(fname);
+    //the file is complete, a transfer that stops now continues with the next one
+    if(RESUME){
+        saveCheckpoint(file_size_RC, fname, file_size_RC, sequence_RC);
+    }
+    free(fname);
+    return 1;
+}
 
+void applicationLayer(const char *serialPort, const char *role, int baudRate,
+                      int nTries, int timeout, const char *filename)
+{
+    LinkLayer connectionParameters;
+    connectionParameters.baudRate = baudRate;
+    connectionParameters.nRetransmissions = nTries; 
+    connectionParameters.role = strcmp(role, "tx") ? LlRx : LlTx;
+    strcpy(connectionParameters.serialPort,serialPort);
+    connectionParameters.timeout = timeout;
+
+    //the transmitter asks for the checkpoint of the receiver, the receiver gives it if there is one
+    if(RESUME){
+        if(connectionParameters.role == LlTx){
+            llsetresume(NULL, 0);
+        }
+        else{
+            llsetresume(checkpoint, loadCheckpoint(filename));
+        }
+    }
+
+    if(llopen(connectionParameters) < 0){
+        perror("Error in the connection\n");
+        exit(-1);
+    }
+
+    double start_time = currentTime();
+    double end_time = 0;
+    int compression = COMPRESSION ? COMPRESS_LZ : COMPRESS_NONE; //of the data packets, the receiver gets it in the start packet
+    int files = 0;
+
+    //the compression history continues from one file to the next
+    compressStreamInit(&compress_stream);
+
+    switch(connectionParameters.role){
+        case LlTx:
+        if(listFiles(filename) == 0){
+            perror("There are no files to send\n");
+            exit(-1);
+        }
+
+        //continues the batch from the file the receiver was writing, the ones before it are complete
+        int first = 0;
+        int resume_offset = 0;
+        int sequence = 0;
+        if(RESUME && llgetresume(checkpoint) == CHECKPOINT_SIZE){
+            for(int i = 0; i < batch_length; i++){
+                struct stat info;
+                if(stat(batch_paths[i], &info) == 0 && getValue(&checkpoint[0]) == info.st_size &&
+                   getValue(&checkpoint[8]) == nameHash(baseName(batch_paths[i])) &&
+                   getValue(&checkpoint[4]) <= info.st_size){
+                    first = i;
+                    resume_offset = getValue(&checkpoint[4]);
+                    sequence = checkpoint[12] + 1;
                     break;
-                
                 }
-                else{
-                    //data packet received. Write the data into the file
-                    processDataPacket(packet_RC, &sequence_RC, content_received, &packet_size_RC);
-
-                    fwrite(content_received, sizeof(unsigned char), packet_size_RC, newFile);
-                }  
             }
+        }
+
+        for(int i = first; i < batch_length; i++){
+            sendFile(batch_paths[i], i == first ? resume_offset : 0, i == first ? sequence : 0);
+            free(batch_paths[i]);
+            files++;
+        }
+        free(batch_paths);
+        end_time = currentTime();
+        break;
 
-            fclose(newFile);
-            free(packet_RC);
-            free(content_received);
+        case LlRx:
+            //the blocks of the queue fit the data of any packet (after the decompression)
+            if(WRITE_QUEUE_DEPTH > 0){
+                if(startWriter() < 0){
+                    printf("Error while starting the writer thread\n");
+                    exit(-1);
+                }
+            }
 
+            //receives files until the transmitter closes the connection
+            while(receiveFile(filename, files, &compression) > 0){
+                files++;
+                end_time = currentTime();
+            }
 
+            if(WRITE_QUEUE_DEPTH > 0){
+                stopWriter();
+            }
+            if(files == 0){
+                printf("The connection was closed before the start packet\n");
+                exit(-1);
+            }
+            if(RESUME){
+                removeCheckpoint();
+            }
         break;
         default:
             perror("Role does't exist\n");
@@ -274,5 +1097,29 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
     }
 
     llclose(TRUE); 
+
+    if(files > 1){
+        printf("Files = %d\n", files);
+    }
+    //system calls (or io_uring submissions) for the data of the received files
+    if(output_writes > 0){
+        printf("Output = %s, %lld writes of %.0f bytes on average\n", output_name, output_writes,
+               (double) output_bytes / output_writes);
+    }
+    if(compression != COMPRESS_NONE){
+        printf("Data packets = %d (%d compressed)\n", data_packets, compressed_packets);
+        printf("Compression = %lld bytes of the file in %lld bytes of data (ratio %.2f)\n", file_bytes, data_bytes,
+               data_bytes > 0 ? (double) file_bytes / data_bytes : 0.0);
+    }
+    //blocks waiting for the writer thread each time the receiver added one
+    if(WRITE_QUEUE_DEPTH > 0 && connectionParameters.role == LlRx){
+        printf("Write queue = %d of %d blocks at most (%.1f on average), full %d times\n", write_queue.maxDepth,
+               WRITE_QUEUE_DEPTH, write_queue.pushes > 0 ? (double) write_queue.depthSum / write_queue.pushes : 0.0,
+               write_queue.fullWaits);
+    }
+    //the goodput is the file data over the time from the start packet to the end packet
+    if(end_time > start_time){
+        printf("Goodput = %.0f bit/s\n", file_bytes * 8 / (end_time - start_time));
+    }
     
 }
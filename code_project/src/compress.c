@@ -0,0 +1,273 @@
+// Chunk compression implementation
+
+#include "compress.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// Each sequence is a token (literal length in the high 4 bits, match length - 4
+// in the low 4 bits), more length bytes when a field is 15, the literals, and
+// the 2 byte offset of the match (least significant byte first). The last
+// sequence only has literals.
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // The last bytes are always literals
+#define MF_LIMIT 12     // No match starts in the last bytes
+#define SKIP_TRIGGER 6  // The search step grows after 2^SKIP_TRIGGER misses
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static int hash4(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - COMPRESS_HASH_LOG);
+}
+
+// Bytes needed by a length field bigger than 15.
+static int lengthBytes(int length)
+{
+    return length >= 15 ? (length - 15) / 255 + 1 : 0;
+}
+
+static unsigned char *writeLength(unsigned char *op, int length)
+{
+    if (length < 15)
+    {
+        return op;
+    }
+    length -= 15;
+    while (length >= 255)
+    {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+// Write a sequence with the literals from anchor and a match of matchLength
+// bytes at offset (no match if matchLength is 0). Return NULL if it doesn't fit.
+static unsigned char *writeSequence(unsigned char *op, const unsigned char *oend,
+                                    const unsigned char *anchor, int literals,
+                                    int offset, int matchLength)
+{
+    int needed = 1 + lengthBytes(literals) + literals;
+    if (matchLength > 0)
+    {
+        needed += 2 + lengthBytes(matchLength - MIN_MATCH);
+    }
+    if (needed > oend - op)
+    {
+        return NULL;
+    }
+
+    unsigned char *token = op++;
+    *token = (literals < 15 ? literals : 15) << 4;
+    op = writeLength(op, literals);
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    if (matchLength > 0)
+    {
+        int length = matchLength - MIN_MATCH;
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        *token |= length < 15 ? length : 15;
+        op = writeLength(op, length);
+    }
+    return op;
+}
+
+void compressStreamInit(CompressStream *stream)
+{
+    stream->length = 0;
+    memset(stream->table, -1, sizeof(stream->table));
+}
+
+unsigned char *compressStreamNext(CompressStream *stream, int size)
+{
+    if (stream->length + size > (int)sizeof(stream->window))
+    {
+        // Keep only the history the next chunk can use, the positions in the table move with it
+        int shift = stream->length - COMPRESS_HISTORY_SIZE;
+        memmove(stream->window, stream->window + shift, COMPRESS_HISTORY_SIZE);
+        stream->length = COMPRESS_HISTORY_SIZE;
+        for (int i = 0; i < (1 << COMPRESS_HASH_LOG); i++)
+        {
+            stream->table[i] = stream->table[i] >= shift ? stream->table[i] - shift : -1;
+        }
+    }
+    return stream->window + stream->length;
+}
+
+void compressStreamCommit(CompressStream *stream, int size)
+{
+    stream->length += size;
+}
+
+int compressStreamChunk(CompressStream *stream, unsigned char *dst, int dstCapacity, int size)
+{
+    const unsigned char *window = stream->window;
+    int *table = stream->table;
+
+    const unsigned char *ip = window + stream->length;
+    const unsigned char *anchor = ip;
+    const unsigned char *iend = ip + size;
+    const unsigned char *mflimit = iend - MF_LIMIT;
+    const unsigned char *matchlimit = iend - LAST_LITERALS;
+    unsigned char *op = dst;
+    const unsigned char *oend = dst + dstCapacity;
+    compressStreamCommit(stream, size);
+
+    if (size > MF_LIMIT)
+    {
+        while (ip < mflimit)
+        {
+            // Find a match, with a bigger step after many misses
+            const unsigned char *match = NULL;
+            int searches = 1 << SKIP_TRIGGER;
+            while (ip < mflimit)
+            {
+                uint32_t sequence = read32(ip);
+                int h = hash4(sequence);
+                int candidate = table[h];
+                table[h] = ip - window;
+                if (candidate >= 0 && (ip - window) - candidate <= COMPRESS_HISTORY_SIZE &&
+                    read32(window + candidate) == sequence)
+                {
+                    match = window + candidate;
+                    break;
+                }
+                ip += searches++ >> SKIP_TRIGGER;
+            }
+            if (match == NULL)
+            {
+                break;
+            }
+
+            // Extend it backwards over the literals and then forwards
+            while (ip > anchor && match > window && ip[-1] == match[-1])
+            {
+                ip--;
+                match--;
+            }
+            const unsigned char *end = ip + MIN_MATCH;
+            const unsigned char *ref = match + MIN_MATCH;
+            while (end < matchlimit && *end == *ref)
+            {
+                end++;
+                ref++;
+            }
+
+            op = writeSequence(op, oend, anchor, ip - anchor, ip - match, end - ip);
+            if (op == NULL)
+            {
+                return 0;
+            }
+
+            // The position before the end also goes in the table, repeated data often matches there
+            table[hash4(read32(end - 2))] = end - 2 - window;
+            ip = end;
+            anchor = ip;
+        }
+    }
+
+    op = writeSequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == NULL)
+    {
+        return 0;
+    }
+    return op - dst;
+}
+
+// Read the rest of a length field that is 15. Return -1 past the end of the input.
+static int readLength(const unsigned char **ip, const unsigned char *iend, int length)
+{
+    if (length < 15)
+    {
+        return length;
+    }
+    unsigned char byte;
+    do
+    {
+        if (*ip >= iend)
+        {
+            return -1;
+        }
+        byte = *(*ip)++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+const unsigned char *decompressStreamChunk(CompressStream *stream, const unsigned char *src, int size, int expected)
+{
+    if (expected > COMPRESS_MAX_CHUNK)
+    {
+        return NULL;
+    }
+
+    const unsigned char *ip = src;
+    const unsigned char *iend = src + size;
+    unsigned char *dst = compressStreamNext(stream, expected);
+    unsigned char *op = dst;
+    unsigned char *oend = dst + expected;
+
+    while (ip < iend)
+    {
+        int token = *ip++;
+
+        int literals = readLength(&ip, iend, token >> 4);
+        if (literals < 0 || literals > iend - ip || literals > oend - op)
+        {
+            return NULL;
+        }
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        // The last sequence has no match
+        if (ip == iend)
+        {
+            break;
+        }
+
+        if (iend - ip < 2)
+        {
+            return NULL;
+        }
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int matchLength = readLength(&ip, iend, token & 15);
+        if (offset == 0 || offset > op - stream->window || matchLength < 0 || matchLength + MIN_MATCH > oend - op)
+        {
+            return NULL;
+        }
+        matchLength += MIN_MATCH;
+
+        // A match closer than its length repeats the bytes it is copying
+        const unsigned char *match = op - offset;
+        if (offset >= matchLength)
+        {
+            memcpy(op, match, matchLength);
+            op += matchLength;
+        }
+        else
+        {
+            for (int i = 0; i < matchLength; i++)
+            {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    if (op != oend)
+    {
+        return NULL;
+    }
+    compressStreamCommit(stream, expected);
+    return dst;
+}
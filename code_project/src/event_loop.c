@@ -0,0 +1,255 @@
+// Event loop implementation
+
+#include "event_loop.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct
+{
+    int active;
+    long long expiryMs; // CLOCK_MONOTONIC time of expiry
+    TimerHandler handler;
+} Timer;
+
+static int epollFd = -1;
+static int timerFd = -1;
+static int serialFd = -1;
+static int wakeFd = -1;
+static Timer timers[MAX_TIMERS];
+
+// Current time of the monotonic clock in milliseconds.
+long long currentTimeMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Arm the timerfd for the timer that expires first (or disarm it if no timer
+// is running).
+static int armTimerFd()
+{
+    long long first = -1;
+    for (int i = 0; i < MAX_TIMERS; i++)
+    {
+        if (timers[i].active && (first < 0 || timers[i].expiryMs < first))
+        {
+            first = timers[i].expiryMs;
+        }
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (first >= 0)
+    {
+        // An absolute time of 0 would disarm the timer
+        if (first == 0)
+        {
+            first = 1;
+        }
+        spec.it_value.tv_sec = first / 1000;
+        spec.it_value.tv_nsec = (first % 1000) * 1000000;
+    }
+
+    if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+    {
+        perror("timerfd_settime");
+        return -1;
+    }
+    return 0;
+}
+
+// Create the event loop for the serial port file descriptor fd.
+// Returns -1 on error, with the descriptors opened so far closed again.
+int eventLoopOpen(int fd)
+{
+    memset(timers, 0, sizeof(timers));
+    serialFd = fd;
+
+    epollFd = epoll_create1(0);
+    if (epollFd == -1)
+    {
+        perror("epoll_create1");
+        eventLoopClose();
+        return -1;
+    }
+
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timerFd == -1)
+    {
+        perror("timerfd_create");
+        eventLoopClose();
+        return -1;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+
+    event.data.fd = serialFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, serialFd, &event) == -1)
+    {
+        perror("epoll_ctl");
+        eventLoopClose();
+        return -1;
+    }
+
+    event.data.fd = timerFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event) == -1)
+    {
+        perror("epoll_ctl");
+        eventLoopClose();
+        return -1;
+    }
+
+    wakeFd = eventfd(0, EFD_NONBLOCK);
+    if (wakeFd == -1)
+    {
+        perror("eventfd");
+        eventLoopClose();
+        return -1;
+    }
+
+    event.data.fd = wakeFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) == -1)
+    {
+        perror("epoll_ctl");
+        eventLoopClose();
+        return -1;
+    }
+
+    return 0;
+}
+
+// Stop every timer and close the event loop.
+void eventLoopClose()
+{
+    memset(timers, 0, sizeof(timers));
+
+    if (timerFd >= 0)
+    {
+        close(timerFd);
+        timerFd = -1;
+    }
+    if (wakeFd >= 0)
+    {
+        close(wakeFd);
+        wakeFd = -1;
+    }
+    if (epollFd >= 0)
+    {
+        close(epollFd);
+        epollFd = -1;
+    }
+}
+
+// Start (or restart) the timer timerId to expire in timeoutMs milliseconds.
+// Returns -1 on error.
+int startTimer(int timerId, int timeoutMs, TimerHandler handler)
+{
+    if (timerId < 0 || timerId >= MAX_TIMERS)
+    {
+        return -1;
+    }
+
+    timers[timerId].active = 1;
+    timers[timerId].expiryMs = currentTimeMs() + timeoutMs;
+    timers[timerId].handler = handler;
+
+    return armTimerFd();
+}
+
+// Stop the timer timerId without calling its handler.
+void stopTimer(int timerId)
+{
+    if (timerId < 0 || timerId >= MAX_TIMERS || !timers[timerId].active)
+    {
+        return;
+    }
+
+    timers[timerId].active = 0;
+    armTimerFd();
+}
+
+// Call the handlers of the timers that already expired.
+static void runExpiredTimers()
+{
+    uint64_t expirations;
+    while (read(timerFd, &expirations, sizeof(expirations)) > 0)
+        ;
+
+    long long now = currentTimeMs();
+    for (int i = 0; i < MAX_TIMERS; i++)
+    {
+        if (timers[i].active && timers[i].expiryMs <= now)
+        {
+            // The handler may start the timer again
+            timers[i].active = 0;
+            timers[i].handler(i);
+        }
+    }
+
+    armTimerFd();
+}
+
+// Make the eventLoopWait running in another thread return. Safe to call from
+// any thread.
+void eventLoopWake()
+{
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    {
+        perror("eventfd write");
+    }
+}
+
+// Wait up to waitMs milliseconds for bytes in the serial port.
+// Returns -1 on error, 0 if no bytes arrived (or a timer expired, or
+// eventLoopWake was called), 1 if there are bytes to read.
+int eventLoopWait(int waitMs)
+{
+    struct epoll_event events[3];
+
+    int n = epoll_wait(epollFd, events, 3, waitMs);
+    if (n == -1)
+    {
+        if (errno == EINTR)
+        {
+            return 0;
+        }
+        perror("epoll_wait");
+        return -1;
+    }
+
+    int readable = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (events[i].data.fd == timerFd)
+        {
+            runExpiredTimers();
+            // Let the caller see the expired timer before reading more bytes
+            return 0;
+        }
+        if (events[i].data.fd == wakeFd)
+        {
+            // Only interrupts the wait, bytes that arrived meanwhile are still reported
+            uint64_t wakes;
+            while (read(wakeFd, &wakes, sizeof(wakes)) > 0)
+                ;
+        }
+        if (events[i].data.fd == serialFd)
+        {
+            readable = 1;
+        }
+    }
+
+    return readable;
+}
@@ -0,0 +1,211 @@
+// Frame check sequence implementation
+
+#include "fcs.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // Reflected Castagnoli polynomial
+#define CRC32C_RESIDUE 0xB798B438 // CRC-32C register after data followed by its CRC
+
+typedef uint32_t (*Crc32cKernel)(uint32_t crc, const unsigned char *data, int size);
+
+static uint32_t crc32cTable[8][256]; // Slice-by-8 tables
+static Crc32cKernel crc32cImpl = NULL;
+static const char *crc32cImplName = "";
+
+// Build the slice-by-8 tables. Table k gives the CRC of a byte followed by k
+// zero bytes.
+static void buildCrc32cTables()
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        }
+        crc32cTable[0][i] = crc;
+    }
+
+    for (int i = 0; i < 256; i++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            uint32_t previous = crc32cTable[k - 1][i];
+            crc32cTable[k][i] = (previous >> 8) ^ crc32cTable[0][previous & 0xFF];
+        }
+    }
+}
+
+// Software kernel: 8 bytes per step with the slice-by-8 tables.
+static uint32_t crc32cSliceBy8(uint32_t crc, const unsigned char *data, int size)
+{
+    while (size >= 8)
+    {
+        uint32_t low = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 |
+                              (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        uint32_t high = (uint32_t)data[4] | (uint32_t)data[5] << 8 |
+                        (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+
+        crc = crc32cTable[7][low & 0xFF] ^ crc32cTable[6][(low >> 8) & 0xFF] ^
+              crc32cTable[5][(low >> 16) & 0xFF] ^ crc32cTable[4][low >> 24] ^
+              crc32cTable[3][high & 0xFF] ^ crc32cTable[2][(high >> 8) & 0xFF] ^
+              crc32cTable[1][(high >> 16) & 0xFF] ^ crc32cTable[0][high >> 24];
+
+        data += 8;
+        size -= 8;
+    }
+
+    while (size > 0)
+    {
+        crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *data) & 0xFF];
+        data++;
+        size--;
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+// Hardware kernel: the SSE4.2 crc32 instruction, 8 bytes at a time.
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const unsigned char *data, int size)
+{
+    uint64_t crc64 = crc;
+    while (size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+
+    crc = (uint32_t)crc64;
+    while (size > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data);
+        data++;
+        size--;
+    }
+
+    return crc;
+}
+#endif
+
+// Choose the fastest kernel that the CPU supports.
+static void selectCrc32cKernel()
+{
+    buildCrc32cTables();
+    crc32cImpl = crc32cSliceBy8;
+    crc32cImplName = "slice-by-8";
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc32cImpl = crc32cSse42;
+        crc32cImplName = "sse4.2";
+    }
+#endif
+}
+
+// Update a CRC-32C with size bytes of data.
+uint32_t crc32cUpdate(uint32_t crc, const unsigned char *data, int size)
+{
+    if (crc32cImpl == NULL)
+    {
+        selectCrc32cKernel();
+    }
+
+    return crc32cImpl(crc, data, size);
+}
+
+// Name of the CRC-32C kernel chosen for this CPU.
+const char *crc32cKernel()
+{
+    if (crc32cImpl == NULL)
+    {
+        selectCrc32cKernel();
+    }
+
+    return crc32cImplName;
+}
+
+// Number of bytes of the frame check sequence fcsType.
+int fcsSize(int fcsType)
+{
+    return fcsType == FCS_CRC32C ? 4 : 1;
+}
+
+// Name of the frame check sequence fcsType.
+const char *fcsName(int fcsType)
+{
+    return fcsType == FCS_CRC32C ? "CRC-32C" : "BCC2";
+}
+
+// Compute the frame check sequence fcsType of size bytes of data into fcs.
+void computeFcs(int fcsType, const unsigned char *data, int size, unsigned char *fcs)
+{
+    if (fcsType == FCS_CRC32C)
+    {
+        uint32_t crc = ~crc32cUpdate(0xFFFFFFFF, data, size);
+        fcs[0] = crc & 0xFF;
+        fcs[1] = (crc >> 8) & 0xFF;
+        fcs[2] = (crc >> 16) & 0xFF;
+        fcs[3] = (crc >> 24) & 0xFF;
+        return;
+    }
+
+    unsigned char bcc2 = 0;
+    for (int i = 0; i < size; i++)
+    {
+        bcc2 ^= data[i];
+    }
+    fcs[0] = bcc2;
+}
+
+// Start the running check of a received frame.
+uint32_t fcsCheckStart(int fcsType)
+{
+    return fcsType == FCS_CRC32C ? 0xFFFFFFFF : 0;
+}
+
+// Add size received bytes to the running check.
+uint32_t fcsCheckUpdate(int fcsType, uint32_t check, const unsigned char *data, int size)
+{
+    if (fcsType == FCS_CRC32C)
+    {
+        return crc32cUpdate(check, data, size);
+    }
+
+    // BCC2: xor of every byte, 8 at a time
+    uint64_t xor = 0;
+    int i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        xor ^= word;
+    }
+    xor ^= xor >> 32;
+    xor ^= xor >> 16;
+    xor ^= xor >> 8;
+    check ^= xor & 0xFF;
+
+    for (; i < size; i++)
+    {
+        check ^= data[i];
+    }
+    return check;
+}
+
+// The data followed by its frame check sequence was received intact.
+int fcsCheckOk(int fcsType, uint32_t check)
+{
+    // The xor of the data and its BCC2 is 0
+    return check == (fcsType == FCS_CRC32C ? CRC32C_RESIDUE : 0);
+}
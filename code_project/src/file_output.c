@@ -0,0 +1,476 @@
+// File output implementation
+
+#define _GNU_SOURCE // O_DIRECT
+
+#include "file_output.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_ENTRIES OUTPUT_BUFFERS
+
+// There is no liburing here, so the ring is set up with the system calls.
+static int uringSetup(FileOutput *output)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring == -1)
+    {
+        return -1;
+    }
+
+    output->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    output->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        // The two rings share one mapping
+        if (output->cqRingSize > output->sqRingSize)
+        {
+            output->sqRingSize = output->cqRingSize;
+        }
+        output->cqRingSize = 0;
+    }
+    output->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    output->sqRing = mmap(NULL, output->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    output->cqRing = output->sqRing;
+    if (output->sqRing != MAP_FAILED && output->cqRingSize > 0)
+    {
+        output->cqRing = mmap(NULL, output->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+    }
+    output->sqes = mmap(NULL, output->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+    if (output->sqRing == MAP_FAILED || output->cqRing == MAP_FAILED || output->sqes == MAP_FAILED)
+    {
+        if (output->sqes != MAP_FAILED)
+        {
+            munmap(output->sqes, output->sqesSize);
+        }
+        if (output->cqRing != MAP_FAILED && output->cqRing != output->sqRing)
+        {
+            munmap(output->cqRing, output->cqRingSize);
+        }
+        if (output->sqRing != MAP_FAILED)
+        {
+            munmap(output->sqRing, output->sqRingSize);
+        }
+        close(ring);
+        return -1;
+    }
+
+    unsigned char *sq = output->sqRing;
+    unsigned char *cq = output->cqRing;
+    output->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    output->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    output->sqArray = (unsigned *)(sq + params.sq_off.array);
+    output->cqHead = (unsigned *)(cq + params.cq_off.head);
+    output->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    output->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    output->cqes = cq + params.cq_off.cqes;
+    output->ring = ring;
+    output->inFlight = 0;
+    return 0;
+}
+
+static void uringFree(FileOutput *output)
+{
+    munmap(output->sqes, output->sqesSize);
+    if (output->cqRing != output->sqRing)
+    {
+        munmap(output->cqRing, output->cqRingSize);
+    }
+    munmap(output->sqRing, output->sqRingSize);
+    close(output->ring);
+    output->ring = -1;
+}
+
+// Queue a write of the buffer and submit it. The kernel owns the buffer until
+// its completion is reaped.
+static int uringSubmit(FileOutput *output, int buffer, int size, long offset)
+{
+    unsigned tail = *output->sqTail;
+    unsigned index = tail & *output->sqMask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)output->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = output->fd;
+    sqe->addr = (unsigned long)output->buffers[buffer];
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = ((unsigned long long)buffer << 32) | (unsigned)size;
+    output->sqArray[index] = index;
+
+    // The entry is visible to the kernel before the new tail
+    atomic_store_explicit((_Atomic unsigned *)output->sqTail, tail + 1, memory_order_release);
+
+    int submitted;
+    while ((submitted = syscall(__NR_io_uring_enter, output->ring, 1, 0, 0, NULL, 0)) == -1 && errno == EINTR)
+        ;
+    if (submitted != 1)
+    {
+        return -1;
+    }
+    output->busy[buffer] = 1;
+    output->inFlight++;
+    return 0;
+}
+
+// Wait for at least one write to complete and reap every completion.
+static int uringReap(FileOutput *output)
+{
+    int result = 0;
+    while (syscall(__NR_io_uring_enter, output->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1)
+    {
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+
+    unsigned head = *output->cqHead;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)output->cqTail, memory_order_acquire);
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = (struct io_uring_cqe *)output->cqes + (head & *output->cqMask);
+        int buffer = cqe->user_data >> 32;
+        int size = cqe->user_data & 0xFFFFFFFF;
+        if (cqe->res != size)
+        {
+            // An error or a short write (the disk is full)
+            errno = cqe->res < 0 ? -cqe->res : ENOSPC;
+            result = -1;
+        }
+        output->busy[buffer] = 0;
+        output->inFlight--;
+        head++;
+    }
+    atomic_store_explicit((_Atomic unsigned *)output->cqHead, head, memory_order_release);
+    return result;
+}
+
+static int uringWaitAll(FileOutput *output)
+{
+    int result = 0;
+    while (output->inFlight > 0)
+    {
+        int inFlight = output->inFlight;
+        if (uringReap(output) == -1)
+        {
+            result = -1;
+            if (output->inFlight == inFlight)
+            {
+                break; // The wait itself failed
+            }
+        }
+    }
+    return result;
+}
+
+// Write size bytes of the buffer at offset, the whole size or an error.
+static int writeBuffer(FileOutput *output, int buffer, int size, long offset)
+{
+    output->writes++;
+    output->bytes += size;
+    if (output->backend == OUTPUT_URING)
+    {
+        return uringSubmit(output, buffer, size, offset);
+    }
+
+    int written = 0;
+    while (written < size)
+    {
+        int res = pwrite(output->fd, output->buffers[buffer] + written, size - written, offset + written);
+        if (res == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (res <= 0)
+        {
+            return -1;
+        }
+        written += res;
+    }
+    return 0;
+}
+
+// With O_DIRECT the writes start at a block boundary, so the current buffer
+// starts with the bytes of the file before offset in its block.
+static int startBuffer(FileOutput *output, long offset)
+{
+    long blockOffset = offset;
+    if (output->direct)
+    {
+        blockOffset = offset - offset % OUTPUT_ALIGN;
+    }
+
+    output->bufferOffset = blockOffset;
+    output->length = offset - blockOffset;
+    if (output->length > 0)
+    {
+        unsigned char *buffer = output->buffers[output->current];
+        int res = pread(output->fd, buffer, OUTPUT_ALIGN, blockOffset);
+        if (res == -1)
+        {
+            return -1;
+        }
+        if (res < output->length)
+        {
+            memset(buffer + res, 0, output->length - res);
+        }
+    }
+    return 0;
+}
+
+// Write the full current buffer and move to the next one, after the write of
+// that one is done.
+static int flushFullBuffer(FileOutput *output)
+{
+    if (writeBuffer(output, output->current, OUTPUT_BUFFER_SIZE, output->bufferOffset) == -1)
+    {
+        return -1;
+    }
+
+    output->current = (output->current + 1) % OUTPUT_BUFFERS;
+    while (output->busy[output->current])
+    {
+        if (uringReap(output) == -1)
+        {
+            return -1;
+        }
+    }
+    output->bufferOffset += OUTPUT_BUFFER_SIZE;
+    output->length = 0;
+    return 0;
+}
+
+// Write what there is in the current buffer (the last block padded with O_DIRECT)
+// and keep the bytes of the last incomplete block for the next write.
+static int flushPartialBuffer(FileOutput *output)
+{
+    if (output->length == 0)
+    {
+        return 0;
+    }
+
+    int size = output->length;
+    int keep = 0;
+    if (output->direct)
+    {
+        keep = size % OUTPUT_ALIGN;
+        if (keep > 0)
+        {
+            memset(output->buffers[output->current] + size, 0, OUTPUT_ALIGN - keep);
+            size += OUTPUT_ALIGN - keep;
+        }
+    }
+
+    if (writeBuffer(output, output->current, size, output->bufferOffset) == -1)
+    {
+        return -1;
+    }
+    if (output->backend == OUTPUT_URING && uringWaitAll(output) == -1)
+    {
+        return -1;
+    }
+
+    int done = output->length - keep;
+    unsigned char *buffer = output->buffers[output->current];
+    memmove(buffer, buffer + done, keep);
+    output->bufferOffset += done;
+    output->length = keep;
+    return 0;
+}
+
+int outputOpen(FileOutput *output, const char *path, long offset, int backend, int direct)
+{
+    memset(output, 0, sizeof(*output));
+    output->fd = -1;
+    output->ring = -1;
+    output->backend = backend;
+
+    int flags = O_RDWR | O_CREAT;
+    if (offset == 0)
+    {
+        flags |= O_TRUNC;
+    }
+    if (direct)
+    {
+        output->fd = open(path, flags | O_DIRECT, 0644);
+        if (output->fd == -1 && errno == EINVAL)
+        {
+            printf("O_DIRECT not supported for %s, using buffered writes\n", path);
+        }
+        output->direct = output->fd != -1;
+    }
+    if (output->fd == -1)
+    {
+        output->fd = open(path, flags, 0644);
+        if (output->fd == -1)
+        {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < OUTPUT_BUFFERS; i++)
+    {
+        if (posix_memalign((void **)&output->buffers[i], OUTPUT_ALIGN, OUTPUT_BUFFER_SIZE) != 0)
+        {
+            output->buffers[i] = NULL;
+            outputClose(output, 0);
+            return -1;
+        }
+    }
+
+    if (backend == OUTPUT_URING && uringSetup(output) == -1)
+    {
+        printf("io_uring not available (%s), using pwrite\n", strerror(errno));
+        output->backend = OUTPUT_PWRITE;
+    }
+
+    output->end = offset;
+    if (startBuffer(output, offset) == -1)
+    {
+        outputClose(output, 0);
+        return -1;
+    }
+    return 0;
+}
+
+int outputWrite(FileOutput *output, long offset, const unsigned char *data, int size)
+{
+    if (offset != output->bufferOffset + output->length)
+    {
+        // Not after the data in the buffer: write that first
+        if (flushPartialBuffer(output) == -1 || startBuffer(output, offset) == -1)
+        {
+            return -1;
+        }
+    }
+
+    while (size > 0)
+    {
+        int chunk = OUTPUT_BUFFER_SIZE - output->length;
+        if (chunk > size)
+        {
+            chunk = size;
+        }
+        memcpy(output->buffers[output->current] + output->length, data, chunk);
+        output->length += chunk;
+        data += chunk;
+        size -= chunk;
+
+        if (output->length == OUTPUT_BUFFER_SIZE && flushFullBuffer(output) == -1)
+        {
+            return -1;
+        }
+    }
+
+    long end = output->bufferOffset + output->length;
+    if (end > output->end)
+    {
+        output->end = end;
+    }
+    return 0;
+}
+
+int outputSync(FileOutput *output, int durable)
+{
+    if (flushPartialBuffer(output) == -1)
+    {
+        return -1;
+    }
+    if (output->backend == OUTPUT_URING && uringWaitAll(output) == -1)
+    {
+        return -1;
+    }
+    if (durable && fdatasync(output->fd) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+long outputCheckpoint(FileOutput *output, int durable)
+{
+    // Up to the last block boundary, the writes stay as big and aligned as the ones of the full buffers
+    long end = output->bufferOffset + output->length;
+    int size = end - end % OUTPUT_ALIGN - output->bufferOffset;
+    if (size > 0)
+    {
+        if (writeBuffer(output, output->current, size, output->bufferOffset) == -1)
+        {
+            return -1;
+        }
+        if (output->backend == OUTPUT_URING && uringWaitAll(output) == -1)
+        {
+            return -1;
+        }
+
+        unsigned char *buffer = output->buffers[output->current];
+        memmove(buffer, buffer + size, output->length - size);
+        output->bufferOffset += size;
+        output->length -= size;
+    }
+    if (output->backend == OUTPUT_URING && uringWaitAll(output) == -1)
+    {
+        return -1;
+    }
+    if (durable && fdatasync(output->fd) == -1)
+    {
+        return -1;
+    }
+    return output->bufferOffset;
+}
+
+int outputClose(FileOutput *output, int durable)
+{
+    int result = 0;
+    if (output->buffers[OUTPUT_BUFFERS - 1] != NULL) // Opened completely
+    {
+        result = outputSync(output, 0);
+
+        // The padding of the last block is not part of the file
+        if (output->direct && ftruncate(output->fd, output->end) == -1)
+        {
+            result = -1;
+        }
+        if (durable && fdatasync(output->fd) == -1)
+        {
+            result = -1;
+        }
+    }
+
+    if (output->ring != -1)
+    {
+        uringWaitAll(output);
+        uringFree(output);
+    }
+    for (int i = 0; i < OUTPUT_BUFFERS; i++)
+    {
+        free(output->buffers[i]);
+        output->buffers[i] = NULL;
+    }
+    if (output->fd != -1 && close(output->fd) == -1)
+    {
+        result = -1;
+    }
+    output->fd = -1;
+    return result;
+}
+
+const char *outputName(FileOutput *output)
+{
+    if (output->backend == OUTPUT_URING)
+    {
+        return output->direct ? "io_uring with O_DIRECT" : "io_uring";
+    }
+    return output->direct ? "pwrite with O_DIRECT" : "pwrite";
+}
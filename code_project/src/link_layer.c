@@ -1,16 +1,21 @@
 // Link layer protocol implementation
 
-#include "link_layer.h"
-#include "serial_port.h"
+#include "link_layer_ext.h"
+#include "transport.h"
+#include "event_loop.h"
+#include "fcs.h"
+#include "stuffing.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
-#include <signal.h>
 #include <stdbool.h>
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
@@ -26,7 +31,125 @@
 #define C_REJ 0x54
 #define C_DISC 0x0B
 #define ESC 0x7d
-#define N(s) ((s % 2) << 6)
+
+//sliding window (Go-Back-N). With a window of 1 the protocol is the original stop-and-wait
+#ifndef WINDOW_SIZE
+#define WINDOW_SIZE 1
+#endif
+
+//stop-and-wait keeps the 1 bit sequence numbers (I0/I1, RR0/RR1, REJ0/REJ1).
+//Bigger windows use 3 bit sequence numbers: I = 0x00..0x70, RR = 0xA0..0xA7, REJ = 0x58..0x5F
+#if WINDOW_SIZE > 1
+#define SEQ_MODULUS 8
+#define N_SHIFT 4
+#define C_RR_BASE 0xA0
+#define C_REJ_BASE 0x58
+#else
+#define SEQ_MODULUS 2
+#define N_SHIFT 6
+#define C_RR_BASE C_RR0
+#define C_REJ_BASE C_REJ
+#endif
+
+//Selective-Repeat instead of Go-Back-N: the receiver keeps the frames that arrive after a lost one
+//and the sender only sends again the frames that were rejected or timed out
+#ifndef SELECTIVE_REPEAT
+#define SELECTIVE_REPEAT 0
+#endif
+
+//the rr and rej ranges can't share a control field with an I frame (multiples of 1 << N_SHIFT below SEQ_MODULUS << N_SHIFT)
+#define OVERLAPS_I_FRAMES(base) ((base) < (SEQ_MODULUS << N_SHIFT) && \
+                                 ((base) % (1 << N_SHIFT) == 0 || (base) % (1 << N_SHIFT) + SEQ_MODULUS > (1 << N_SHIFT)))
+#if OVERLAPS_I_FRAMES(C_RR_BASE) || OVERLAPS_I_FRAMES(C_REJ_BASE)
+#error "The rr or rej control fields overlap the ones of the I frames"
+#endif
+
+#if WINDOW_SIZE < 1 || WINDOW_SIZE >= SEQ_MODULUS
+#error "WINDOW_SIZE must be between 1 and 7"
+#endif
+
+#if SELECTIVE_REPEAT && WINDOW_SIZE > SEQ_MODULUS / 2
+#error "WINDOW_SIZE must be between 1 and 4 with SELECTIVE_REPEAT"
+#endif
+
+//block acknowledgement (Selective-Repeat only): instead of a rej the receiver sends a frame with the next
+//expected frame N(r) and a bitmap of the frames after it that were already kept.
+//FLAG | A | C_SACK | BCC1 | N(r) | BITMAP | BCC2 | FLAG, with N(r), BITMAP and BCC2 stuffed like data
+#ifndef BLOCK_ACK
+#define BLOCK_ACK 0
+#endif
+
+#if BLOCK_ACK && !SELECTIVE_REPEAT
+#error "BLOCK_ACK needs SELECTIVE_REPEAT"
+#endif
+
+#define C_SACK 0xC0
+
+//link calibration: with CALIBRATION=1, llopen of the transmitter sends probe frames (like I frames, with C_PROBE)
+//of two sizes. The receiver answers each one with C_PROBE_OK or C_PROBE_BAD (bcc2 error). The answer times and the
+//probes lost give the bit rate, the round-trip delay and the error rate of the link. Probes and answers carry the
+//number of the probe (modulo PROBE_TAGS) in bits 2 and 3 of the control field, so a late answer to a probe isn't
+//taken for the answer to the next one
+#ifndef CALIBRATION
+#define CALIBRATION 0
+#endif
+#define CALIBRATION_PROBES 8
+#define SMALL_PROBE_SIZE 16
+#define MIN_PAYLOAD_SIZE 64
+#define PROBE_TAGS 4
+#define FOR_EACH_PROBE_TAG(F) F(0), F(1), F(2), F(3)
+#define C_PROBE(t) (0xD0 | (t) << 2)
+#define C_PROBE_OK(t) (0xD1 | (t) << 2)
+#define C_PROBE_BAD(t) (0xD2 | (t) << 2)
+#define PROBE_TAG(c) (((c) >> 2) & (PROBE_TAGS - 1))
+#define SACK_INFO_SIZE 3 //N(r), bitmap and bcc2
+#define SACK_FRAME_SIZE (4 + SACK_INFO_SIZE * 2 + 1) //worst case of the byte stuffing
+
+//frame check sequence of the I frames: FCS_BCC2 (1 byte XOR, the original protocol) or FCS_CRC32C (4 bytes).
+//The transmitter proposes it in the set frame and only uses it if the receiver accepts it in the ua frame
+#ifndef FCS_TYPE
+#define FCS_TYPE FCS_BCC2
+#endif
+
+//biggest information field (data of an I frame) of this build, up to 65535 bytes. The transmitter proposes it in
+//the set frame and both sides use the smallest of their values. Without negotiation it is MAX_PAYLOAD_SIZE
+#ifndef MAX_INFO_SIZE
+#define MAX_INFO_SIZE MAX_PAYLOAD_SIZE
+#endif
+
+#if MAX_INFO_SIZE < MAX_PAYLOAD_SIZE || MAX_INFO_SIZE > 65535
+#error "MAX_INFO_SIZE must be between MAX_PAYLOAD_SIZE and 65535"
+#endif
+
+//negotiation parameters. The set and ua frames of llopen may carry an information field with parameters
+//(type, length, value), followed by a bcc2, stuffed like data:
+//FLAG | A | C | BCC1 | TYPE | LENGTH | VALUE... | BCC2 | FLAG
+//A set without them asks for the original protocol, and the receiver answers only the parameters it received
+#define PARAM_FCS 0x01
+#define PARAM_MAX_INFO 0x02 //2 bytes, least significant first
+#define PARAM_RESUME 0x03 //resume information of the application, empty in the set (the transmitter asks for it)
+#define PARAM_INFO_SIZE (16 + MAX_RESUME_SIZE)
+#define NEGOTIATION_FRAME_SIZE (4 + PARAM_INFO_SIZE * 2 + 1) //worst case of the byte stuffing
+
+//biggest I frame (worst case of the byte stuffing) and biggest data plus frame check sequence received
+#define MAX_FRAME_SIZE (4 + (MAX_INFO_SIZE + MAX_FCS_SIZE) * 2 + 1)
+
+//the buffers of the frame pool also have, after the frame, space for the data of the frame before the stuffing.
+//llreserve gives that space to the application layer, so the data is only copied once, by the stuffing
+#define POOL_FRAME_SIZE (MAX_FRAME_SIZE + MAX_INFO_SIZE)
+#define RESERVED_DATA(frame) ((frame) + MAX_FRAME_SIZE)
+#define RECEIVE_BUFFER_SIZE (MAX_INFO_SIZE + MAX_FCS_SIZE)
+
+#define N(s) (((s) % SEQ_MODULUS) << N_SHIFT)
+#define C_RR(s) (C_RR_BASE + ((s) % SEQ_MODULUS))
+#define C_REJN(s) (C_REJ_BASE + ((s) % SEQ_MODULUS))
+
+//applies F to every sequence number, for the tables built at compile time
+#if SEQ_MODULUS == 8
+#define FOR_EACH_SEQ(F) F(0), F(1), F(2), F(3), F(4), F(5), F(6), F(7)
+#else
+#define FOR_EACH_SEQ(F) F(0), F(1)
+#endif
 
 //states
 typedef enum {
@@ -40,6 +163,22 @@ typedef enum {
     END
 } state;
 
+//types of frame recognized by the frame parser
+typedef enum {
+    FRAME_NONE,
+    FRAME_I,
+    FRAME_PROBE,
+    FRAME_RR,
+    FRAME_REJ,
+    FRAME_SACK,
+    FRAME_PROBE_OK,
+    FRAME_PROBE_BAD,
+    FRAME_SET,
+    FRAME_UA,
+    FRAME_DISC,
+    FRAME_TOO_LONG //I frame with more data than fits in the receive buffer (the flag was probably lost)
+} frame_type;
+
 //command
 typedef enum {
     UA,
@@ -49,560 +188,767 @@ typedef enum {
 
 
 
-//alarm help variables
+//alarm help variables. The retransmission alarm is a timer of the event loop
+#define RETRANSMISSION_TIMER 0
 static int alarmEnabled = FALSE;
 static int alarmCount = 0;
 
-//states when receiving commands and frames
-state state_command = START;
-state state_frame = START;
+//adaptive retransmission timeout. The timeout starts at the configured value and then follows the
+//round-trip times measured between sending a frame and receiving its acknowledgement
+#ifndef ADAPTIVE_TIMEOUT
+#define ADAPTIVE_TIMEOUT 1
+#endif
+#define MIN_TIMEOUT_MS 50
+#define MAX_TIMEOUT_MS 60000
+
+//adaptive payload size. After ADAPT_INTERVAL transmissions (or ADAPT_ERRORS failed ones), the transmitter uses the
+//rejs, timeouts and frames sent again since the last change to pick the payload size with the best expected goodput,
+//up to the negotiated maximum
+#ifndef ADAPTIVE_PAYLOAD
+#define ADAPTIVE_PAYLOAD 1
+#endif
+#define ADAPT_INTERVAL 16
+#define ADAPT_ERRORS 2
+#define PAYLOAD_HISTORY_SIZE 32
+
+//pipelined transmitter. With a depth bigger than 0, llwrite and llcommit only build the stuffed frame in a ring of
+//PIPELINE_DEPTH frames, and a link thread sends the frames of the ring and waits for their acknowledgements, so the
+//application reads the file and builds the next frames while the line waits for the acks
+#ifndef PIPELINE_DEPTH
+#define PIPELINE_DEPTH 0
+#endif
+#define RING_SLOTS (PIPELINE_DEPTH > 0 ? PIPELINE_DEPTH : 1)
+
+//time waited for bytes before assuming that the line is idle (like the 0.1s VTIME of the serial port)
+#define READ_WAIT_MS 100
+
 
 //Values used for the alarm and retransmission system
 int nRetransmissions = 0;
-int timeout = 0;
+int timeout = 0; //in milliseconds
 
 //auxiliary values to use in the state machines
 static int control = 0; 
-static int bcc2_control = 0; 
 
 static int frame_numb = 0; //auxiliary varible to count the frames received
 
+//sender window. frame_numb is the next frame to send and window_base the oldest frame not yet acknowledged
+static unsigned char *window_frames[WINDOW_SIZE];
+static int window_frame_sizes[WINDOW_SIZE];
+static int window_base = 0;
+static bool window_acked[WINDOW_SIZE]; //frame acknowledged by a block ack before the frames in front of it
+static long long window_sent_time[WINDOW_SIZE]; //when the frame was last sent (ms)
+static bool window_retransmitted[WINDOW_SIZE]; //frame sent more than once, its round-trip time is ambiguous
+
+//smoothed round-trip time and its variation (ms), -1 while there are no measurements
+static int srtt = -1;
+static int rttvar = 0;
+
+//settings used by the transmitter, seeded by the link calibration
+static int active_window = WINDOW_SIZE;
+static int payload_size = MAX_PAYLOAD_SIZE;
+
+//adaptive payload size: frames acknowledged and transmissions that failed since the last change, and the sizes
+//chosen (with the frame number where each one started) for the statistics
+static int adapt_frames = 0;
+static int adapt_errors = 0;
+static long long adapt_bytes = 0; //bytes of those frames (after the byte stuffing)
+static int payload_history_frame[PAYLOAD_HISTORY_SIZE];
+static int payload_history_size[PAYLOAD_HISTORY_SIZE];
+static int payload_history_length = 0;
+static long long payload_bytes = 0; //data given to llwrite, for the average size
+static int link_rate = 0; //bit/s, the baudrate or the calibrated rate
+static pthread_mutex_t payload_mutex = PTHREAD_MUTEX_INITIALIZER; //payload_size is read by the application thread
+
+//ring of the pipelined transmitter. The application thread builds frames at ring_tail (numbered from ring_numb) and
+//the link thread moves the one at ring_head into the window, giving its old buffer to the ring
+static unsigned char *ring_frames[RING_SLOTS];
+static int ring_frame_sizes[RING_SLOTS];
+static int ring_payloads[RING_SLOTS];
+static int ring_head = 0;
+static int ring_tail = 0;
+static int ring_count = 0;
+static int ring_numb = 0;
+static bool ring_closing = false; //llclose was called, the link thread stops when the ring is empty
+static bool ring_failed = false; //the link thread gave up on a frame
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_ready = PTHREAD_COND_INITIALIZER; //a frame was added or llclose was called
+static pthread_cond_t ring_space = PTHREAD_COND_INITIALIZER; //a frame was taken or the link thread failed
+static pthread_t link_thread;
+static int ring_waits = 0; //times the window had space but the ring was empty
+
+//results of the link calibration
+static bool calibrated = false;
+static int calibration_rate = 0; //bit/s
+static int calibration_delay = 0; //ms
+static double calibration_error_rate = 0; //fraction of the probes lost or corrupted
+
+//information of the last block acknowledgement received (one more byte to detect longer frames)
+static unsigned char sack_info[SACK_INFO_SIZE + 1];
+
+//information field of the last set or ua received
+static unsigned char param_info[PARAM_INFO_SIZE + 1];
+static int param_length = 0;
+
+static int fcs_type = FCS_BCC2; //frame check sequence in use, agreed in llopen
+static int max_info = MAX_PAYLOAD_SIZE; //biggest information field, agreed in llopen
+static bool negotiating = false; //the set or ua sent carries negotiation parameters
+
+//resume information of the application (llsetresume). The receiver gives its own, the transmitter gets the one of
+//the receiver in llopen
+static unsigned char resume_info[MAX_RESUME_SIZE];
+static int resume_size = 0;
+static bool resume_wanted = false; //the transmitter asks for it, or the receiver was asked for it
+
+//destuffed data and frame check sequence of the I frame being received
+static unsigned char receive_buffer[RECEIVE_BUFFER_SIZE + 1];
+
+static bool reject_sent = false; //receiver already asked for the expected frame again
+static int reject_trigger = -1; //sequence number of the frame out of sequence that made it ask (Go-Back-N)
+static bool disconnected = false; //receiver already answered the disc of the transmitter
+
+//receiver window (Selective-Repeat). Frames received after a lost one wait here, the ones between
+//pending_first and frame_numb were already acknowledged and are delivered by the next calls of llread
+static unsigned char *reorder_frames[WINDOW_SIZE];
+static int reorder_frame_sizes[WINDOW_SIZE];
+static bool reorder_present[WINDOW_SIZE];
+static int reorder_seq[WINDOW_SIZE];
+static int pending_first = 0;
+
 static LinkLayerRole role; //used to check the role in the connection
 
+//buffered reader. The bytes available in the serial port are read at once and given to the state machines one by one
+#define READ_BUFFER_SIZE 4096
+static unsigned char read_buffer[READ_BUFFER_SIZE];
+static int read_buffer_pos = 0;
+static int read_buffer_len = 0;
+
 //used for the statistics
 static int number_timeouts = 0;
 static int number_rTransmissions = 0;
 static int number_rej = 0;
+static int number_sack = 0;
+static int number_read_calls = 0;
 static time_t begin_time;
 static time_t end_time;
 
-// Alarm function handler
-void alarmHandler(int signal)
+// Alarm function handler, called by the event loop when the retransmission timer expires
+void alarmHandler(int timerId)
 {
     alarmEnabled = FALSE;
     alarmCount++;
     number_timeouts++;
     number_rTransmissions++;
     printf("Alarm #%d\n", alarmCount);
+
+    //backoff, the next attempt waits twice as long
+    if(ADAPTIVE_TIMEOUT){
+        timeout = timeout * 2 > MAX_TIMEOUT_MS ? MAX_TIMEOUT_MS : timeout * 2;
+    }
 }
 
-//========================================= STATE MACHINES ======================================================================================
+//updates the smoothed round-trip time with a new measurement and computes the timeout from it (Jacobson/Karels)
+void updateTimeout(long long rtt){
+    if(!ADAPTIVE_TIMEOUT){
+        return;
+    }
 
-//state machine for receiving the UA frame
-void state_machine_UA(unsigned char *received_buf, bool isSender){
-    switch (state_command)
-       {
+    if(srtt < 0){
+        srtt = rtt;
+        rttvar = rtt / 2;
+    }
+    else{
+        int error = srtt > rtt ? srtt - rtt : rtt - srtt;
+        rttvar = (3 * rttvar + error) / 4;
+        srtt = (7 * srtt + rtt) / 8;
+    }
 
-        case START:
-            if(*received_buf == FLAG){
-                state_command = FLAG_RCV;
-            }
-            else{
-                state_command = START;
-            }
-            break;
+    timeout = srtt + 4 * rttvar;
+    if(timeout < MIN_TIMEOUT_MS){
+        timeout = MIN_TIMEOUT_MS;
+    }
+    else if(timeout > MAX_TIMEOUT_MS){
+        timeout = MAX_TIMEOUT_MS;
+    }
+}
 
-        case FLAG_RCV:
-            if((*received_buf == A_RECEIVER && !isSender) || (*received_buf == A_SENDER && isSender) ){
-                state_command = A_RCV;
-            }
-            else if(*received_buf == FLAG){
-                state_command = FLAG;
-            }
-            else{
-                state_command = START;
-            }
-            break;
+//========================================= BUFFERED READER ======================================================================================
+
+//gives the next received byte, reading every byte available in the serial port when the buffer is empty.
+//Waits at most wait_ms for new bytes.
+//Returns -1 on error, 0 if no byte was received, 1 if a byte was received (like readByteSerialPort)
+int readByteBufferedWait(unsigned char *byte, int wait_ms){
+    if(read_buffer_pos == read_buffer_len){
+        //waits for bytes or for a timer to expire
+        int ready = eventLoopWait(wait_ms);
+        if(ready <= 0){
+            return ready;
+        }
 
-        case A_RCV:
-            if(*received_buf == C_UA){
-                state_command = C_RCV;
-            }
-            else if(*received_buf == FLAG){
-                state_command = FLAG;
-            }
-            else{
-                state_command = START;
-            }
-            break;
+        number_read_calls++;
+        int bytes = transportRead(read_buffer, READ_BUFFER_SIZE);
+        if(bytes <= 0){
+            return bytes;
+        }
+        read_buffer_pos = 0;
+        read_buffer_len = bytes;
+    }
 
-        case C_RCV:
-            if(*received_buf == (C_UA ^ A_RECEIVER) && !isSender ){
-                state_command = BCC1_OK;
-            }
-            else if (*received_buf == (C_UA ^ A_SENDER) && isSender){
-                state_command = BCC1_OK;
-            } 
-            else if(*received_buf == FLAG){
-                state_command = FLAG;
-            }
-            else
-            {
-                state_command = START;
-            }
-            break;
+    *byte = read_buffer[read_buffer_pos++];
+    return 1;
+}
 
-        case BCC1_OK:
-            if(*received_buf == FLAG){
-               state_command = END;
-            }    
-            else{
-                state_command = START;
-            }
-            break;
+//gives back the last byte returned by readByteBuffered, so that it is returned again
+void unreadByteBuffered(){
+    if(read_buffer_pos > 0){
+        read_buffer_pos--;
+    }
+}
 
-        default:
-            state_command = START;
-            break;
-        }
+//destuffs the data bytes already in the buffer into dst, up to the closing flag (that stays in the buffer).
+//Returns the number of bytes written
+int readDataBuffered(unsigned char *dst, int dst_size, int *escaped){
+    int written = 0;
+    read_buffer_pos += destuffData(dst, dst_size, read_buffer + read_buffer_pos, read_buffer_len - read_buffer_pos, &written, escaped);
+    return written;
 }
 
-//state machine for receiving the unnumbered frames (rr and rej)
-void state_machine_RR_REJ(unsigned char *received_buf, bool *isRej){
-        unsigned char rrByte = C_RR0 + ((frame_numb + 1) % 2);
-        unsigned char rejByte = C_REJ + (frame_numb % 2);
-        switch (state_command)
-       {
+//gives the next received byte, waiting the usual time for it
+int readByteBuffered(unsigned char *byte){
+    return readByteBufferedWait(byte, READ_WAIT_MS);
+}
 
-        case START:
-            if(*received_buf == FLAG){
-                state_command = FLAG_RCV;
-            }
-            else{
-                state_command = START;
-            }
-            break;
+//========================================= FRAME PARSER ======================================================================================
 
-        case FLAG_RCV:
-            if(*received_buf == A_SENDER){
-                state_command = A_RCV;
-            }
-            else if(*received_buf == FLAG){
-                state_command = FLAG_RCV;
-            }
-            else{
-                state_command = START;
-            }
-            break;
+//every frame is received by the same parser: FLAG | A | C | BCC1 | information... | FLAG.
+//The header is checked byte by byte with the transition table, the information field is destuffed at once
 
-        case A_RCV:
+//what a byte means in the current state of the parser
+typedef enum {
+    EV_FLAG,
+    EV_VALID, //expected address, known control field, bcc1 right or information byte
+    EV_INVALID
+} parser_event;
+
+//next state for each state and event. Any flag that doesn't end a frame can start the next one
+static const state parser_transitions[END + 1][3] = {
+    //             EV_FLAG     EV_VALID   EV_INVALID
+    [START]    = { FLAG_RCV,   START,     START },
+    [FLAG_RCV] = { FLAG_RCV,   A_RCV,     START },
+    [A_RCV]    = { FLAG_RCV,   C_RCV,     START },
+    [C_RCV]    = { FLAG_RCV,   BCC1_OK,   START },
+    [BCC1_OK]  = { END,        DATA,      DATA },
+    [DATA]     = { END,        DATA,      DATA },
+    [END]      = { FLAG_RCV,   A_RCV,     START },
+};
+
+//type of frame of each control field
+#define I_FRAME_TYPE(s) [N(s)] = FRAME_I
+#define RR_FRAME_TYPE(s) [C_RR(s)] = FRAME_RR
+#define REJ_FRAME_TYPE(s) [C_REJN(s)] = FRAME_REJ
+#define PROBE_FRAME_TYPES(t) [C_PROBE(t)] = FRAME_PROBE, [C_PROBE_OK(t)] = FRAME_PROBE_OK, [C_PROBE_BAD(t)] = FRAME_PROBE_BAD
+static const unsigned char control_types[256] = {
+    FOR_EACH_SEQ(I_FRAME_TYPE),
+    FOR_EACH_SEQ(RR_FRAME_TYPE),
+    FOR_EACH_SEQ(REJ_FRAME_TYPE),
+    [C_SACK] = FRAME_SACK,
+    FOR_EACH_PROBE_TAG(PROBE_FRAME_TYPES),
+    [C_SET] = FRAME_SET,
+    [C_UA] = FRAME_UA,
+    [C_DISC] = FRAME_DISC,
+};
+
+//state of the parser and header of the frame being received
+static state parser_state = START;
+static frame_type parser_type = FRAME_NONE;
+static unsigned char parser_address = 0;
+
+//where the information field of the frame goes, its size and the running frame check of I frames
+static unsigned char *parser_info = NULL;
+static int parser_capacity = 0;
+static int parser_length = 0;
+static int parser_escaped = 0;
+static uint32_t parser_check = 0;
+static bool parser_intact = false; //the data of the last I frame (or probe) matched its frame check sequence
+
+//checks the bcc2 (xor of the other bytes) at the end of an information field
+bool checkInfoBcc2(const unsigned char *info, int length){
+    if(length < 1){
+        return false;
+    }
+    unsigned char bcc2;
+    computeFcs(FCS_BCC2, info, length - 1, &bcc2);
+    return bcc2 == info[length - 1];
+}
 
-            if(*received_buf == rrByte){
-                //reveived a rr byte
-                control = rrByte;
-                state_command = C_RCV;
-            }
-            else if(*received_buf == rejByte){
-                //reveived a rej byte
-                control = rejByte;
-                state_command = C_RCV;
-                *isRej = true;
-            }
-            else if(*received_buf == FLAG){
-                state_command = FLAG_RCV;
-            }
-            else{
-                state_command = START;
-            }
+//prepares the information field of a frame whose header was accepted
+void startFrameInfo(){
+    parser_length = 0;
+    parser_escaped = 0;
+
+    switch(parser_type){
+        case FRAME_I:
+        case FRAME_PROBE:
+            parser_info = receive_buffer;
+            parser_capacity = max_info + fcsSize(fcs_type);
+            parser_check = fcsCheckStart(fcs_type);
             break;
-
-        case C_RCV:
-            if(*received_buf == (A_SENDER ^ control)){
-                state_command = BCC1_OK;
-            }  
-            else if(*received_buf == FLAG){
-                state_command = FLAG_RCV;
-            }
-            else
-            {
-                state_command = START;
-            }
+        case FRAME_SACK:
+            parser_info = sack_info;
+            parser_capacity = SACK_INFO_SIZE;
             break;
-
-        case BCC1_OK:
-            if(*received_buf == FLAG){
-                state_command = END;
-            }    
-            else{
-                state_command = START;
-            }
+        case FRAME_SET:
+        case FRAME_UA:
+            parser_info = param_info;
+            parser_capacity = PARAM_INFO_SIZE;
             break;
-
         default:
-            state_command = START;
+            //the other frames don't have information
+            parser_info = NULL;
+            parser_capacity = 0;
             break;
-        }
+    }
 }
 
-//state machine for receiving the set frame
-void state_machine_set(unsigned char *byte){
-    switch (state_command)
-       {
+//gives a byte of the header (or the flags) to the parser
+void parseFrameByte(unsigned char byte){
+    parser_event event = EV_VALID;
 
-        case START:
-            if(*byte == FLAG){
-                state_command = FLAG_RCV;
-            }
-            else{
-                state_command = START;
-            }
-            break;
+    if(byte == FLAG){
+        event = EV_FLAG;
+    }
+    else{
+        switch(parser_state){
+            case FLAG_RCV:
+            case END:
+                parser_address = byte;
+                event = (byte == A_SENDER || byte == A_RECEIVER) ? EV_VALID : EV_INVALID;
+                break;
+            case A_RCV:
+                control = byte;
+                parser_type = control_types[byte];
+                event = parser_type != FRAME_NONE ? EV_VALID : EV_INVALID;
+                break;
+            case C_RCV:
+                event = byte == (parser_address ^ control) ? EV_VALID : EV_INVALID;
+                break;
+            default:
+                break;
+        }
+    }
 
-        case FLAG_RCV:
-            if(*byte == A_SENDER){
-                state_command = A_RCV;
-            }
-            else if(*byte == FLAG){
-                state_command = FLAG_RCV;
-                }
-            else{
-                state_command = START;
-            }
-            break;
+    parser_state = parser_transitions[parser_state][event];
+    if(parser_state == BCC1_OK){
+        startFrameInfo();
+    }
+}
 
-        case A_RCV:
-            if(*byte == C_SET){
-                state_command = C_RCV;
-            }
-            else if(*byte == FLAG){
-                state_command = FLAG_RCV;
-                }
-            else{
-                state_command = START;
-            }
-            break;
+//destuffs the bytes of the information field already received, up to the closing flag. One byte more than the
+//capacity is accepted, so a frame that is too long is noticed
+void parseFrameInfo(){
+    int written = 0;
+    if(parser_info != NULL){
+        written = readDataBuffered(parser_info + parser_length, parser_capacity + 1 - parser_length, &parser_escaped);
+    }
 
-        case C_RCV:
-            if(*byte == (A_SENDER ^ C_SET)){
-                state_command = BCC1_OK;
-            }  
-            else if(*byte == FLAG){
-                state_command = FLAG_RCV;
-                }
-            else
-            {
-                state_command = START;
-            }
-            break;
+    if(parser_info == NULL || parser_length + written > parser_capacity){
+        parser_state = START;
+        return;
+    }
 
-        case BCC1_OK:
-            if(*byte == FLAG){
-                state_command = END;
-            }    
-            else{
-                state_command = START;
-            }
-            break;
+    if(parser_type == FRAME_I || parser_type == FRAME_PROBE){
+        parser_check = fcsCheckUpdate(fcs_type, parser_check, parser_info + parser_length, written);
+    }
+    parser_length += written;
+}
 
+//checks the information field of a complete frame. Returns false if the frame must be ignored
+bool endFrameInfo(){
+    switch(parser_type){
+        case FRAME_I:
+        case FRAME_PROBE:
+            //the data is followed by the frame check sequence
+            if(parser_length == 0){
+                return false;
+            }
+            parser_intact = parser_length >= fcsSize(fcs_type) && fcsCheckOk(fcs_type, parser_check);
+            return true;
+        case FRAME_SACK:
+            return parser_length == SACK_INFO_SIZE && checkInfoBcc2(sack_info, parser_length);
+        case FRAME_SET:
+        case FRAME_UA:
+            //the negotiation parameters are optional and end with a bcc2
+            param_length = parser_length;
+            return parser_length == 0 || (parser_length >= 2 && checkInfoBcc2(param_info, parser_length));
         default:
-            state_command = START;
-            break;
-        }
+            return parser_length == 0;
+    }
 }
 
-//state machine for receiving the disc frame
-void state_machine_disc(unsigned char *byte, bool isSender){
-    switch (state_command)
-       {
-
-        case START:
-            if(*byte == FLAG){
-                state_command = FLAG_RCV;
-            }
-            else{
-                state_command = START;
-            }
-            break;
+//reads bytes until a frame is complete, waiting at most wait_ms for each one.
+//Returns the type of the frame, FRAME_NONE if no byte arrived in time (or a timer expired), -1 on error
+int receiveFrame(int wait_ms){
+    unsigned char byte;
 
-        case FLAG_RCV:
-            if((*byte == A_SENDER && isSender) || (*byte==A_RECEIVER && !isSender)){
-                state_command = A_RCV;
-            }
-            else if(*byte == FLAG){
-                state_command = START;
-                }
-            else{
-                state_command = START;
-            }
-            break;
+    while(true){
+        int result = readByteBufferedWait(&byte, wait_ms);
+        if(result < 0){
+            return -1;
+        }
+        if(result == 0){
+            return FRAME_NONE;
+        }
 
-        case A_RCV:
-            if(*byte == C_DISC){
-                state_command = C_RCV;
-            }
-            else if(*byte == FLAG){
-                state_command = START;
-                }
-            else{
-                state_command = START;
-            }
-            break;
+        parseFrameByte(byte);
 
-        case C_RCV:
-            if(*byte == (A_SENDER ^ C_DISC) || *byte == (A_RECEIVER ^ C_DISC)){
-                state_command = BCC1_OK;
-            }
-              
-            else if(*byte == FLAG){
-                state_command = START;
-                }
-            else
-            {
-                state_command = START;
+        //the information field starts with this byte, the rest already received is destuffed at once
+        if(parser_state == DATA){
+            unreadByteBuffered();
+            parseFrameInfo();
+            if(parser_state == START && (parser_type == FRAME_I || parser_type == FRAME_PROBE)){
+                return FRAME_TOO_LONG;
             }
-            break;
+            continue;
+        }
 
-        case BCC1_OK:
-            if(*byte == FLAG){
-                state_command = END;
-            }    
-            else{
-                state_command = START;
+        if(parser_state == END){
+            if(endFrameInfo()){
+                return parser_type;
             }
-            break;
-
-        default:
-            state_command = START;
-            break;
+            //a broken frame, its closing flag may be the opening flag of the next one
+            parser_state = FLAG_RCV;
         }
+    }
 }
 
-//state machine to process the data frames (I Frames) but also a disc frame received after a data frame 
-void state_machine_data_frame(unsigned char *byte, bool *isDisc,bool *connectionLost, bool *isDuplicated){
-    switch(state_frame){
-        case START:
-            if(*byte == FLAG){
-                state_frame = FLAG_RCV;
-            }
-            else{
-                state_frame = START;
-            }
-            break;
-
-        case FLAG_RCV:
-            if(*byte == A_SENDER){
-                state_frame = A_RCV;
-            }
-            else if(*byte == FLAG){
-                state_frame = FLAG_RCV;
-                }
-            else{
-                state_frame = START;
-            }
-            break;
-
-        case A_RCV:
-            if(*byte == N(frame_numb)){
-                state_frame = C_RCV;
-                break;
-            }
-            if(*byte == N(frame_numb - 1)){
-                //received a duplicated frame, don't need to continue
-                *isDuplicated = true;
-                break;
-            }
-            else if(*byte == FLAG){
-                state_frame = FLAG_RCV;
-                }
-            else if(*byte == C_DISC){
-                //the program is going to terminate
-                *isDisc=true;
-                state_frame=C_RCV;
-            }
-            else{
-                state_frame = START;
-            }
-            break;
+//drops the frame being received (the line stopped in the middle of it)
+void resetFrameParser(){
+    if(parser_state != END){
+        parser_state = START;
+    }
+}
 
-        case C_RCV:
-            if(*byte == (A_SENDER ^ N(frame_numb))){
-                state_frame = BCC1_OK;
-            } 
-            else if(*byte==(A_SENDER ^ C_DISC)) {
-                
-                state_frame=BCC1_OK;
-            }
-            else if(*byte == FLAG){
-                state_frame= FLAG_RCV;
-                }
-            else
-            {
-                state_frame = START;
-            }
-            break;
+// =============================================================================== FRAME POOL ==================================================================================================
+
+//every frame that isn't a constant control frame is built in a buffer of the frame pool: the sender window,
+//the receiver window (Selective-Repeat), the block acks and the negotiation frames. The pool is a fixed arena,
+//so no frame comes from the heap
+#define POOL_FRAMES (2 * WINDOW_SIZE + 2 + PIPELINE_DEPTH)
+static unsigned char frame_pool[POOL_FRAMES][POOL_FRAME_SIZE];
+static unsigned char *pool_free[POOL_FRAMES];
+static int pool_free_count = -1; //-1 until the pool is used for the first time
+
+//pool statistics
+static int pool_in_use = 0;
+static int pool_peak = 0;
+static int pool_gets = 0;
+static int pool_failures = 0;
+
+//takes a frame buffer (POOL_FRAME_SIZE bytes) from the pool. Returns NULL if every buffer is in use
+unsigned char *getPoolFrame(){
+    if(pool_free_count < 0){
+        for(int i = 0; i < POOL_FRAMES; i++){
+            pool_free[i] = frame_pool[POOL_FRAMES - 1 - i];
+        }
+        pool_free_count = POOL_FRAMES;
+    }
 
-        case BCC1_OK:
-            if(*byte==FLAG && *isDisc){
-                
-                state_frame=END;
-            }
-            else if(*byte == FLAG){
-                state_frame = FLAG_RCV;
-            }    
-            else{
-                state_frame = DATA;
-            }
-            break;
+    if(pool_free_count == 0){
+        printf("The frame pool is empty\n");
+        pool_failures++;
+        return NULL;
+    }
 
-        case DATA:
-            //if the connection was previously lost, any flag received is part of a new frame
-            if(*connectionLost && (*byte == FLAG)){
-                state_frame = FLAG_RCV;
-                break;
-            }
-            if(*byte == FLAG){
-                state_frame = END;
-            }
-            break;
-        default:
-            state_frame = START;
-            break;
-        } 
+    pool_gets++;
+    pool_in_use++;
+    if(pool_in_use > pool_peak){
+        pool_peak = pool_in_use;
+    }
+    return pool_free[--pool_free_count];
+}
 
+//gives a frame buffer back to the pool
+void putPoolFrame(unsigned char *frame){
+    if(frame == NULL){
+        return;
+    }
+    pool_free[pool_free_count++] = frame;
+    pool_in_use--;
 }
 
 // =============================================================================== FRAME CREATORS ==================================================================================================
 
-//creates a frame and returns it's size
-int createDataFrame(unsigned char *frame, const unsigned char *buf, int bufSize){
-    frame[0] = FLAG;
-    frame[1] = A_SENDER;
-    frame[2] = N(frame_numb);
-    frame[3] = frame[1] ^ frame[2];
-
-    //inserts the data into the frame
-    unsigned char bcc2 = 0;
-    int frame_index = 4;
-    for(int i = 0; i < bufSize; i++){
-        
-        if(buf[i] == FLAG){
-            //byte stuffing
-            frame[frame_index] = ESC;
-            frame[frame_index + 1] = FLAG ^ 0x20;
-            frame_index = frame_index + 2;
-        }
-        else if(buf[i] == ESC){
+//copies size bytes to the frame from frame_index on, with byte stuffing. Returns the index after the last byte written
+int stuffBytes(unsigned char *frame, int frame_index, const unsigned char *bytes, int size){
+    for(int i = 0; i < size; i++){
+        if(bytes[i] == FLAG || bytes[i] == ESC){
             //byte stuffing
             frame[frame_index] = ESC;
-            frame[frame_index + 1] = ESC ^ 0x20;
+            frame[frame_index + 1] = bytes[i] ^ 0x20;
             frame_index = frame_index + 2;
         }
         else{
-            frame[frame_index] = buf[i];
+            frame[frame_index] = bytes[i];
             frame_index++;
         }
-
-        bcc2 ^= buf[i];
     }
+    return frame_index;
+}
+
+//creates the frame with number numb and returns it's size
+int createDataFrame(unsigned char *frame, int numb, const unsigned char *buf, int bufSize){
+    frame[0] = FLAG;
+    frame[1] = A_SENDER;
+    frame[2] = N(numb);
+    frame[3] = frame[1] ^ frame[2];
+
+    //inserts the data into the frame, computing the frame check sequence in the same pass
+    unsigned char fcs[MAX_FCS_SIZE];
+    int frame_index = 4 + stuffData(frame + 4, buf, bufSize, fcs_type, fcs);
 
-    frame[frame_index] = bcc2;
-    frame_index++;
+    //the frame check sequence is also stuffed, otherwise a byte equal to the flag or to the escape byte would break the frame
+    frame_index = stuffBytes(frame, frame_index, fcs, fcsSize(fcs_type));
     frame[frame_index] = FLAG;
     return frame_index + 1;
 }
 
-//Creates a unNumbered frame (the commands set, ua or disc)
-void createUnnumberedFrame(unsigned char *frame, command cmd, bool isSender){
+//the control frames never change, so they are built at compile time
+#define CONTROL_FRAME_SIZE 5
+#define CONTROL_FRAME(a, c) {FLAG, (a), (c), (a) ^ (c), FLAG}
+
+//unnumbered frames (the commands set, ua or disc) of the receiver and of the transmitter (isSender)
+static const unsigned char unnumbered_frames[2][3][CONTROL_FRAME_SIZE] = {
+    {[UA] = CONTROL_FRAME(A_RECEIVER, C_UA), [DISC] = CONTROL_FRAME(A_RECEIVER, C_DISC), [SET] = CONTROL_FRAME(A_RECEIVER, C_SET)},
+    {[UA] = CONTROL_FRAME(A_SENDER, C_UA), [DISC] = CONTROL_FRAME(A_SENDER, C_DISC), [SET] = CONTROL_FRAME(A_SENDER, C_SET)},
+};
+
+//supervision frames (rr and rej) for each sequence number, both ask for that frame acknowledging every frame before it
+#define RR_FRAME(s) CONTROL_FRAME(A_SENDER, C_RR(s))
+#define REJ_FRAME(s) CONTROL_FRAME(A_SENDER, C_REJN(s))
+static const unsigned char rr_frames[SEQ_MODULUS][CONTROL_FRAME_SIZE] = {FOR_EACH_SEQ(RR_FRAME)};
+static const unsigned char rej_frames[SEQ_MODULUS][CONTROL_FRAME_SIZE] = {FOR_EACH_SEQ(REJ_FRAME)};
+
+//answers to the calibration probes (corrupted and intact) for each probe number
+#define PROBE_ANSWER_FRAMES(t) {CONTROL_FRAME(A_SENDER, C_PROBE_BAD(t)), CONTROL_FRAME(A_SENDER, C_PROBE_OK(t))}
+static const unsigned char probe_answer_frames[PROBE_TAGS][2][CONTROL_FRAME_SIZE] = {FOR_EACH_PROBE_TAG(PROBE_ANSWER_FRAMES)};
+
+//Creates a block ack frame: the next expected frame and a bitmap of the frames kept after it. Returns it's size
+int createBlockAckFrame(unsigned char *frame){
+    unsigned char info[SACK_INFO_SIZE];
+    info[0] = frame_numb % SEQ_MODULUS;
+    info[1] = 0;
+    for(int i = 0; i < WINDOW_SIZE; i++){
+        int ahead = reorder_seq[i] - frame_numb - 1;
+        if(reorder_present[i] && ahead >= 0 && ahead < SEQ_MODULUS - 1){
+            info[1] |= 1 << ahead;
+        }
+    }
+    computeFcs(FCS_BCC2, info, 2, &info[2]);
+
     frame[0] = FLAG;
-    frame[4] = FLAG;
+    frame[1] = A_SENDER;
+    frame[2] = C_SACK;
+    frame[3] = A_SENDER ^ C_SACK;
+
+    int frame_index = stuffBytes(frame, 4, info, SACK_INFO_SIZE);
+    frame[frame_index] = FLAG;
+    return frame_index + 1;
+}
+
+//writes the negotiation parameters proposed (transmitter) or accepted (receiver), followed by their bcc2. Returns their size
+int createParameters(unsigned char *info){
+    int length = 0;
+    info[length++] = PARAM_FCS;
+    info[length++] = 1;
+    info[length++] = fcs_type;
+    info[length++] = PARAM_MAX_INFO;
+    info[length++] = 2;
+    info[length++] = max_info & 0xFF;
+    info[length++] = (max_info >> 8) & 0xFF;
+    if(resume_wanted){
+        info[length++] = PARAM_RESUME;
+        if(role == LlTx){
+            info[length++] = 0;
+        }
+        else{
+            info[length++] = resume_size;
+            memcpy(&info[length], resume_info, resume_size);
+            length += resume_size;
+        }
+    }
 
-    if(isSender){
-        frame[1]=A_SENDER;
+    computeFcs(FCS_BCC2, info, length, &info[length]);
+    return length + 1;
+}
+
+//uses the negotiation parameters of the last set or ua received. Unknown parameters are ignored and
+//values that aren't supported keep the original protocol
+void applyParameters(){
+    fcs_type = FCS_BCC2;
+    max_info = MAX_PAYLOAD_SIZE;
+    if(role == LlTx){
+        resume_size = 0;
     }
     else{
-        frame[1]=A_RECEIVER;
+        resume_wanted = false;
     }
 
-    switch(cmd){
-        case UA:
-            frame[2] = C_UA;
-            frame[3] = frame[1] ^ C_UA;
-            break;
-        case DISC:
-            frame[2] = C_DISC;
-            frame[3] = frame[1] ^ C_DISC;
-            break;
-        case SET:
-            frame[2] = C_SET;
-            frame[3] = frame[1] ^ C_SET;
+    //the last byte is the bcc2
+    int i = 0;
+    while(i + 2 <= param_length - 1){
+        unsigned char type = param_info[i];
+        int length = param_info[i + 1];
+        if(i + 2 + length > param_length - 1){
             break;
+        }
+
+        if(type == PARAM_FCS && length == 1 && param_info[i + 2] <= FCS_CRC32C){
+            fcs_type = param_info[i + 2];
+        }
+        else if(type == PARAM_MAX_INFO && length == 2){
+            //the smallest of the two sides, never less than a packet with the name of the file needs
+            int value = param_info[i + 2] | (param_info[i + 3] << 8);
+            if(value >= MIN_PAYLOAD_SIZE){
+                max_info = value < MAX_INFO_SIZE ? value : MAX_INFO_SIZE;
+            }
+        }
+        else if(type == PARAM_RESUME && length <= MAX_RESUME_SIZE){
+            if(role == LlTx){
+                memcpy(resume_info, &param_info[i + 2], length);
+                resume_size = length;
+            }
+            else{
+                resume_wanted = true;
+            }
+        }
+        i += 2 + length;
     }
-    
 }
 
-//Creates a supervision frame (rr or rej)
-void createSuperVisionFrame(unsigned char *frame, bool *isRej){
-    frame[0] = FLAG;
-    frame[1] = A_SENDER;
-
-    if(*isRej){
-        frame[2] = C_REJ + (frame_numb % 2);
-        frame[3] = A_SENDER ^ (C_REJ + (frame_numb % 2));
-    }
-    else{
-        frame[2] = C_RR0 + ((frame_numb + 1) % 2);
-        frame[3] = A_SENDER ^ (C_RR0 + ((frame_numb + 1) % 2));
-    }
+//Creates a set or ua frame with the negotiation parameters. Returns it's size
+int createNegotiationFrame(unsigned char *frame, command cmd){
+    memcpy(frame, unnumbered_frames[1][cmd], 4);
 
-    frame[4] = FLAG;
+    unsigned char info[PARAM_INFO_SIZE];
+    int length = createParameters(info);
+    int frame_index = stuffBytes(frame, 4, info, length);
+    frame[frame_index] = FLAG;
+    return frame_index + 1;
 }
 
 // ==================================================================================== FRAME SENDERS AND RECEIVERS (SUPERVISOR AND UNNNUMBERED) ====================================================================================
 
 //sends an unnumbered frame (command) 
 int sendUnnumberedFrame(command cmd, bool isSender){
-    unsigned char *frame = (unsigned char*)malloc(sizeof(unsigned char) * 5);
-
-    //creates the frame to send
-    createUnnumberedFrame(frame, cmd, isSender);
-   
     //sends the frame
-    int bytes = writeBytesSerialPort(frame, 5);
+    int bytes = transportWrite(unnumbered_frames[isSender][cmd], CONTROL_FRAME_SIZE);
     printf("%d bytes have been written\n",bytes);
     
     //waits until all bytes have been written in the serial port
-    sleep(1);
+    transportDrain();
     
 
     if(bytes < 0){
-        free(frame);
         printf("failed do send\n");
         return -1;
     }
 
-    free(frame);
     return 0;
 }
 
-//sends a supervision frame
-int sendSupervisionFrame(bool *isRej){
+//sends the set (transmitter) or the ua (receiver) of llopen, with the negotiation parameters if there are any
+int sendNegotiationFrame(command cmd){
+    if(!negotiating){
+        return sendUnnumberedFrame(cmd, true);
+    }
 
-    unsigned char *frame = (unsigned char*)malloc(sizeof(unsigned char) * 5);
-    createSuperVisionFrame(frame, isRej);
+    unsigned char *frame = getPoolFrame();
+    if(frame == NULL){
+        return -1;
+    }
+    int frame_size = createNegotiationFrame(frame, cmd);
 
-    //sends the supervision frame
-    int bytes = writeBytesSerialPort(frame, 5);
+    int bytes = transportWrite(frame, frame_size);
+    printf("%d bytes have been written\n",bytes);
+    putPoolFrame(frame);
 
-    // Wait until all bytes have been written to the serial port
-    sleep(1);
+    //waits until all bytes have been written in the serial port
+    transportDrain();
 
     if(bytes < 0){
-        free(frame);
+        printf("failed do send\n");
         return -1;
     }
-    free(frame);
-
     return 0;
 }
 
-//receives and unnumbered frame (command)
-int receiveUnnumberedFrame(command cmd, bool isSender, bool hasTimeout){
-    state_command = START;
-    unsigned char *received_frame = (unsigned char*)malloc(sizeof(unsigned char));
-
+//sends a supervision frame
+int sendSupervisionFrame(bool *isRej){
+    int bytes;
 
-    int byte = 0;
-    state_command = START;
+    //with block acks, a rej is replaced by a frame saying which frames were already kept
+    if(BLOCK_ACK && *isRej){
+        unsigned char *frame = getPoolFrame();
+        if(frame == NULL){
+            return -1;
+        }
+        int frame_size = createBlockAckFrame(frame);
+        number_sack++;
+        bytes = transportWrite(frame, frame_size);
+        putPoolFrame(frame);
+    }
+    else if(*isRej){
+        bytes = transportWrite(rej_frames[frame_numb % SEQ_MODULUS], CONTROL_FRAME_SIZE);
+    }
+    else{
+        bytes = transportWrite(rr_frames[frame_numb % SEQ_MODULUS], CONTROL_FRAME_SIZE);
+    }
+
+    // Wait until all bytes have been written to the serial port
+    transportDrain();
+
+    if(bytes < 0){
+        return -1;
+    }
+
+    return 0;
+}
+
+//answers the calibration probe with number tag, saying if it arrived without errors
+int sendProbeAnswer(int tag, bool intact){
+    int bytes = transportWrite(probe_answer_frames[tag][intact], CONTROL_FRAME_SIZE);
+
+    // Wait until all bytes have been written to the serial port
+    transportDrain();
+
+    return bytes < 0 ? -1 : 0;
+}
+
+//answers the frames that arrive when another one was expected
+void dispatchFrame(int type){
+    //the transmitter sent the set again, so the ua was lost
+    if(type == FRAME_SET && role == LlRx){
+        printf("Set received again, answering with the ua\n");
+        sendNegotiationFrame(UA);
+    }
+}
+
+//receives and unnumbered frame (command)
+int receiveUnnumberedFrame(command cmd, bool isSender, bool hasTimeout){
+    int expected = FRAME_NONE;
+    switch(cmd){
+        case UA:
+            expected = FRAME_UA;
+            break;
+        case DISC:
+            expected = FRAME_DISC;
+            break;
+        case SET:
+            expected = FRAME_SET;
+            break;
+    }
+    //the set always comes from the transmitter
+    unsigned char address = (isSender || cmd == SET) ? A_SENDER : A_RECEIVER;
 
     while (true)
     {   
@@ -612,51 +958,30 @@ int receiveUnnumberedFrame(command cmd, bool isSender, bool hasTimeout){
             return 1;
         }
         
-        
-        // Returns after 1 char have been input
-        byte = readByteSerialPort(received_frame);
+        int type = receiveFrame(READ_WAIT_MS);
 
-        if(byte == -1){
+        if(type < 0){
             break;
         }
-        else if(byte == 0){
+        else if(type == FRAME_NONE){
             continue;
         }
 
-        //choose the correct state machine
-        switch(cmd){
-            case UA:
-                state_machine_UA(received_frame, isSender);
-                break;
-            case DISC:
-                state_machine_disc(received_frame, isSender);
-                break;
-            case SET:
-                state_machine_set(received_frame);
-                break;
-
-        }
-
-
-
-        if(state_command == END){
+        if(type == expected && parser_address == address){
             printf("Command %d reveived successfully\n", cmd);
             
             if(hasTimeout){
-                alarm(0);
+                stopTimer(RETRANSMISSION_TIMER);
             }
-
-            free(received_frame);
             return 0;
         }
 
+        dispatchFrame(type);
     }
 
     if(hasTimeout){
-        alarm(0);
+        stopTimer(RETRANSMISSION_TIMER);
     }
-
-    free(received_frame);
     return -1;
 
 
@@ -667,119 +992,685 @@ int receiveUnnumberedFrame(command cmd, bool isSender, bool hasTimeout){
 //Connects the Sender to the receiver (sends the Set frame and waits the reception of the UA frame)
 int connectToReceiver(){
 
-    printf("New termios structure set\n");
+    printf("New termios structure set\n");
+
+
+    
+    int byte = 0;
+    alarmCount = 0;
+    alarmEnabled = FALSE;
+    long long sent_time = 0;
+
+    //proposes the frame check sequence and the information field size, the original protocol doesn't need negotiation
+    fcs_type = FCS_TYPE;
+    max_info = MAX_INFO_SIZE;
+    negotiating = fcs_type != FCS_BCC2 || max_info != MAX_PAYLOAD_SIZE || resume_wanted;
+
+    //waits timeout time for the UA message. Tries n times to send the message
+    while (alarmCount < nRetransmissions)
+    {
+        if (alarmEnabled == FALSE)
+        {
+            sendNegotiationFrame(SET);
+            sent_time = currentTimeMs();
+
+            startTimer(RETRANSMISSION_TIMER, timeout, alarmHandler); // Set alarm to be triggered in timeout milliseconds
+            alarmEnabled = TRUE;
+        }
+
+        byte = receiveUnnumberedFrame(UA, true, true);
+
+        if(byte == 0){
+            printf("Connection to receiver completed\n");
+
+            //a receiver that doesn't answer the parameters only knows the original protocol
+            applyParameters();
+
+            //with the adaptive payload size the frames start at the original size and grow while the link is clean,
+            //the first frames are already in the window before any error is seen
+            payload_size = ADAPTIVE_PAYLOAD && max_info > MAX_PAYLOAD_SIZE ? MAX_PAYLOAD_SIZE : max_info;
+
+            //the first measurement of the round-trip time, if the set wasn't sent again
+            if(alarmCount == 0){
+                updateTimeout(currentTimeMs() - sent_time);
+            }
+            number_rTransmissions += alarmCount;
+            stopTimer(RETRANSMISSION_TIMER);
+            return 0;
+        }
+
+        else if(byte < 0){
+            break;
+        }
+        
+
+    }
+
+    number_rTransmissions += alarmCount;
+
+    stopTimer(RETRANSMISSION_TIMER);
+    return -1;
+}
+
+//receives the set frame and sends the UA frame in order to connect to the receiver
+int connectToSender(){
+
+    if(receiveUnnumberedFrame(SET, false, false) < 0 ){
+        return -1;
+    }
+
+    //accepts the parameters that it knows and answers them
+    applyParameters();
+    negotiating = param_length > 0;
+    if(sendNegotiationFrame(UA) < 0){
+        return -1;
+    }
+
+    printf("Connection to the receiver completed\n");
+
+    return 0;
+}
+
+//terminates the connection between the receiver and the transmitter
+int terminate_connection(){
+    
+
+    
+    int byte = 0;
+    alarmCount = 0;
+    alarmEnabled = FALSE;
+
+
+
+    //waits timeout time for the disc message. Tries n times to send the message
+    while (alarmCount < nRetransmissions)
+    {
+        if (alarmEnabled == FALSE)
+        {
+            startTimer(RETRANSMISSION_TIMER, timeout, alarmHandler); // Set alarm to be triggered in timeout milliseconds
+            alarmEnabled = TRUE;
+            
+            if(sendUnnumberedFrame(DISC, true) != 0){
+                return -1;
+            }
+
+        }
+
+        byte = receiveUnnumberedFrame(DISC, false, true);
+
+
+        if(byte == 0){
+            number_rTransmissions += alarmCount;
+            if(sendUnnumberedFrame(UA, false) < 0){
+                return -1;
+            }
+            stopTimer(RETRANSMISSION_TIMER);
+            return 0;
+        }
+
+        else if(byte < 0){
+            break;
+        }
+        
+
+    }
+
+    number_rTransmissions += alarmCount;
+    stopTimer(RETRANSMISSION_TIMER);
+    return -1;
+}
+
+//===================================================================================================== SENDER WINDOW (GO-BACK-N / SELECTIVE-REPEAT) ========================================================================= 
+
+//sends again the frames of the window from first to last (not included)
+int resendWindow(int first, int last){
+    for(int i = first; i < last; i++){
+        int slot = i % WINDOW_SIZE;
+        int bytes = transportWrite(window_frames[slot], window_frame_sizes[slot]);
+        printf("%d bytes written (frame %d)\n", bytes, i);
+
+        // Wait until all bytes have been written to the serial port
+        transportDrain();
+        window_sent_time[slot] = currentTimeMs();
+        window_retransmitted[slot] = true;
+
+        if(bytes < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//frames sent again after a timeout or a rej: only the first one with Selective-Repeat, the rest of the window with Go-Back-N
+int resendLimit(){
+    return SELECTIVE_REPEAT ? window_base + 1 : frame_numb;
+}
+
+//time (ms) before a frame that block acks still report missing is sent again. The block acks sent before the copy
+//arrived come back in less than its round trip, the one answering the copy after it, so the guard stays a little
+//below the round-trip time (the timeout before it is measured)
+int resendGuard(){
+    if(srtt < 0){
+        return timeout;
+    }
+    return srtt > rttvar ? srtt - rttvar : 0;
+}
+
+//payload size with the best expected goodput when frames of frame_bytes are lost or corrupted with frame_error_rate
+//and each frame costs overhead bytes more: sqrt(overhead / byte error rate)
+int goodputPayload(double frame_error_rate, double frame_bytes, double overhead){
+    double byte_error_rate = 1 - pow(1 - frame_error_rate, 1 / frame_bytes);
+    int size = (int) sqrt(overhead / byte_error_rate);
+    if(size < MIN_PAYLOAD_SIZE){
+        size = MIN_PAYLOAD_SIZE;
+    }
+    else if(size > max_info){
+        size = max_info;
+    }
+    return size;
+}
+
+//saves the payload size used from the next frame on. When the history is full the last entry is replaced
+void recordPayloadSize(){
+    if(payload_history_length > 0 && payload_history_size[payload_history_length - 1] == payload_size){
+        return;
+    }
+    if(payload_history_length == PAYLOAD_HISTORY_SIZE){
+        payload_history_length--;
+    }
+    payload_history_frame[payload_history_length] = frame_numb;
+    payload_history_size[payload_history_length] = payload_size;
+    payload_history_length++;
+}
+
+//counts frames acknowledged (or failed transmissions) and chooses the payload size again when there are enough of them.
+//Without errors the size doubles up to the maximum, with errors it moves to the best one for the error rate measured
+//(at most twice the current size, the estimate of a few frames is rough)
+void adaptPayload(int first, int last, bool failed){
+    if(!ADAPTIVE_PAYLOAD){
+        return;
+    }
+
+    //frames of the window from first to last (not included)
+    for(int i = first; i < last; i++){
+        adapt_bytes += window_frame_sizes[i % WINDOW_SIZE];
+    }
+    if(failed){
+        adapt_errors += last - first;
+    }
+    else{
+        adapt_frames += last - first;
+    }
+    if(adapt_frames + adapt_errors < ADAPT_INTERVAL && adapt_errors < ADAPT_ERRORS){
+        return;
+    }
+
+    int size = payload_size * 2;
+    if(adapt_errors > 0){
+        //one more transmission in the count, so failures alone don't give a certain loss
+        double frame_error_rate = (double) adapt_errors / (adapt_frames + adapt_errors + 1);
+        double bytes_per_ms = link_rate / 10.0 / 1000.0;
+        double frame_bytes = (double) adapt_bytes / (adapt_frames + adapt_errors);
+
+        //stop-and-wait also pays the turnaround (round-trip time without the frame) of every frame
+        double overhead = 16;
+        if(active_window == 1 && srtt >= 0 && bytes_per_ms > 0){
+            double turnaround = srtt - frame_bytes / bytes_per_ms;
+            if(turnaround > 0){
+                overhead += turnaround * bytes_per_ms;
+            }
+        }
+
+        int best = goodputPayload(frame_error_rate, frame_bytes, overhead);
+        if(best < size){
+            size = best;
+        }
+    }
+    pthread_mutex_lock(&payload_mutex);
+    payload_size = size > max_info ? max_info : size;
+    pthread_mutex_unlock(&payload_mutex);
+    recordPayloadSize();
+
+    adapt_frames = 0;
+    adapt_errors = 0;
+    adapt_bytes = 0;
+}
+
+//the pipelined transmitter has a frame in the ring and the window has space for it
+bool pipelineReady(){
+    if(PIPELINE_DEPTH == 0 || frame_numb - window_base >= active_window){
+        return false;
+    }
+    pthread_mutex_lock(&ring_mutex);
+    bool ready = ring_count > 0;
+    pthread_mutex_unlock(&ring_mutex);
+    return ready;
+}
+
+//waits for the supervision frames until at most max_outstanding frames are waiting for an acknowledgement.
+//On a timeout or a rej the oldest frame (Selective-Repeat) or the whole window (Go-Back-N) is sent again.
+//The link thread of the pipelined transmitter also stops waiting when the next frame of the ring can be sent
+int waitAcknowledgements(int max_outstanding){
+    while(true){
+
+        //the acknowledgements that already arrived are handled first, so a timer that expired
+        //while the frames were being written doesn't send again frames that were received
+        int type = receiveFrame(0);
+
+        //the event loop reports the expired timer before the bytes that arrived with it, so they are read now
+        if(type == FRAME_NONE && alarmEnabled == FALSE){
+            type = receiveFrame(0);
+        }
+        if(type < 0){
+            return -1;
+        }
+        if(type == FRAME_NONE){
+
+            //the oldest frame of the window wasn't acknowledged in time
+            if(frame_numb > window_base && alarmEnabled == FALSE){
+                if(alarmCount >= nRetransmissions){
+                    return -1;
+                }
+                adaptPayload(window_base, window_base + 1, true);
+                if(resendWindow(window_base, resendLimit()) < 0){
+                    return -1;
+                }
+                startTimer(RETRANSMISSION_TIMER, timeout, alarmHandler);
+                alarmEnabled = TRUE;
+            }
+
+            if(frame_numb - window_base <= max_outstanding || pipelineReady()){
+                return 0;
+            }
+
+            type = receiveFrame(READ_WAIT_MS);
+            if(type < 0){
+                return -1;
+            }
+        }
+
+        //only the supervision frames matter here (a late answer to a calibration probe is ignored)
+        if(type != FRAME_RR && type != FRAME_REJ && type != FRAME_SACK){
+            dispatchFrame(type);
+            continue;
+        }
+        bool isRej = type == FRAME_REJ;
+
+        //finds the frame of the window that the sequence number refers to. A rr(n) acknowledges every frame before n
+        int seq;
+        if(type == FRAME_SACK){
+            seq = sack_info[0];
+        }
+        else{
+            seq = control - (isRej ? C_REJ_BASE : C_RR_BASE);
+        }
+        int acked = -1;
+        for(int i = window_base; i <= frame_numb; i++){
+            if(i % SEQ_MODULUS == seq){
+                acked = i;
+                break;
+            }
+        }
+        if(acked < 0){
+            //old supervision frame, ignore it
+            continue;
+        }
+
+        //a rej of the next frame to send: the receiver has all the frames sent (its rr was lost), like a rr
+        if(isRej && acked == frame_numb){
+            isRej = false;
+        }
+
+        for(int i = window_base; i < acked; i++){
+            printf("Frame %d sent successfully\n", i);
+        }
+
+        if(acked > window_base){
+            //measures the round-trip time with the newest frame acknowledged (Karn: only if it was sent once)
+            int newest = (acked - 1) % WINDOW_SIZE;
+            if(!window_retransmitted[newest]){
+                updateTimeout(currentTimeMs() - window_sent_time[newest]);
+            }
+
+            adaptPayload(window_base, acked, false);
+            window_base = acked;
+            alarmCount = 0;
+        }
+
+        if(type == FRAME_SACK){
+            //marks the frames the receiver already kept and sends again the ones missing before them. A frame sent
+            //again less than a round trip ago is skipped, the block ack was on its way before that copy arrived.
+            //N(r) itself is always missing
+            int last_kept = window_base + 1;
+            for(int i = 0; i < SEQ_MODULUS - 1; i++){
+                int kept = window_base + 1 + i;
+                if((sack_info[1] & (1 << i)) && kept < frame_numb){
+                    window_acked[kept % WINDOW_SIZE] = true;
+                    last_kept = kept;
+                }
+            }
+
+            stopTimer(RETRANSMISSION_TIMER);
+            long long now = currentTimeMs();
+            for(int i = window_base; i < last_kept; i++){
+                int slot = i % WINDOW_SIZE;
+                if(window_acked[slot] || (window_retransmitted[slot] && now - window_sent_time[slot] < resendGuard())){
+                    continue;
+                }
+                printf("Frame %d was sent with problems. Trying again\n", i);
+                number_rTransmissions++;
+                adaptPayload(i, i + 1, true);
+                alarmCount = 0;
+                if(resendWindow(i, i + 1) < 0){
+                    return -1;
+                }
+            }
+            startTimer(RETRANSMISSION_TIMER, timeout, alarmHandler);
+            alarmEnabled = TRUE;
+        }
+        else if(isRej){
+            number_rTransmissions++;
+            adaptPayload(acked, acked + 1, true);
+            alarmCount = 0;
+            printf("Frame %d was sent with problems. Trying again\n", acked);
+            stopTimer(RETRANSMISSION_TIMER);
+            if(resendWindow(window_base, resendLimit()) < 0){
+                return -1;
+            }
+            startTimer(RETRANSMISSION_TIMER, timeout, alarmHandler);
+            alarmEnabled = TRUE;
+        }
+        else{
+            //restarts the timer for the frames still waiting
+            stopTimer(RETRANSMISSION_TIMER);
+            alarmEnabled = FALSE;
+            if(frame_numb > window_base){
+                startTimer(RETRANSMISSION_TIMER, timeout, alarmHandler);
+                alarmEnabled = TRUE;
+            }
+        }
+    }
+}
+
+//sends the next I frame, already built in its place of the window, with bufSize bytes of data.
+//Returns the number of bytes written or -1 on error
+int sendDataFrame(int bufSize){
+
+    //the window was empty, so the timer starts with this frame
+    bool windowWasEmpty = (frame_numb == window_base);
+    if(windowWasEmpty){
+        alarmCount = 0;
+    }
+
+    int slot = frame_numb % WINDOW_SIZE;
+    window_acked[slot] = false;
+
+    //sends the frame
+    int bytes = transportWrite(window_frames[slot], window_frame_sizes[slot]);
+    printf("%d bytes written\n", bytes);
+    // Wait until all bytes have been written to the serial port
+    transportDrain();
+    window_sent_time[slot] = currentTimeMs();
+    window_retransmitted[slot] = false;
+
+    if(bytes < 0){
+        return -1;
+    }
+    frame_numb++;
+    payload_bytes += bufSize;
+
+    if(windowWasEmpty){
+        startTimer(RETRANSMISSION_TIMER, timeout, alarmHandler); // Set alarm to be triggered in timeout milliseconds
+        alarmEnabled = TRUE;
+    }
+
+    return bytes;
+}
+
+//creates the next I frame in its place of the window, sends it and waits until there is space for the one after it.
+//Returns the number of bytes written or -1 on error
+int writeDataFrame(const unsigned char *buf, int bufSize){
+    int slot = frame_numb % WINDOW_SIZE;
+    window_frame_sizes[slot] = createDataFrame(window_frames[slot], frame_numb, buf, bufSize);
+
+    int bytes = sendDataFrame(bufSize);
+    if(bytes < 0){
+        return -1;
+    }
+
+    //only returns when there is space in the window for the next frame (with a window of 1, when this frame was acknowledged)
+    if(waitAcknowledgements(active_window - 1) < 0){
+        stopTimer(RETRANSMISSION_TIMER);
+        return -1;
+    }
 
-    //starts the alarm
-    (void)signal(SIGALRM, alarmHandler);
+    return bytes;
+}
 
-    
-    int byte = 0;
-    alarmCount = 0;
-    alarmEnabled = FALSE;
-    state_command = START;
+//===================================================================================================== PIPELINED TRANSMITTER ========================================================================= 
 
+//waits until the tail of the ring is free. Returns false if the link thread failed
+bool waitRingSpace(){
+    pthread_mutex_lock(&ring_mutex);
+    while(ring_count == PIPELINE_DEPTH && !ring_failed){
+        pthread_cond_wait(&ring_space, &ring_mutex);
+    }
+    bool failed = ring_failed;
+    pthread_mutex_unlock(&ring_mutex);
+    return !failed;
+}
 
+//builds the next frame with bufSize bytes of data at the tail of the ring (already free) and gives it to the link thread.
+//Returns the size of the frame
+int pushRingFrame(const unsigned char *buf, int bufSize){
+    //only the application thread uses the tail, the link thread takes the frames at the head
+    int size = createDataFrame(ring_frames[ring_tail], ring_numb, buf, bufSize);
+    ring_frame_sizes[ring_tail] = size;
+    ring_payloads[ring_tail] = bufSize;
+
+    pthread_mutex_lock(&ring_mutex);
+    ring_tail = (ring_tail + 1) % RING_SLOTS;
+    ring_numb++;
+    ring_count++;
+    pthread_cond_signal(&ring_ready);
+    pthread_mutex_unlock(&ring_mutex);
+
+    //the link thread may be waiting for acknowledgements in the event loop
+    eventLoopWake();
+    return size;
+}
 
-    //waits timeout time for the UA message. Tries n times to send the message
-    while (alarmCount < nRetransmissions)
-    {
-        if (alarmEnabled == FALSE)
-        {
-            alarm(timeout); // Set alarm to be triggered in timout seconds
-            alarmEnabled = TRUE;
-            
-            sendUnnumberedFrame(SET, true);
+//moves the frame at the head of the ring to its place in the window (the buffer there, of a frame already acknowledged,
+//goes to the ring) and sends it. Returns the number of bytes written or -1 on error
+int sendRingFrame(){
+    int slot = frame_numb % WINDOW_SIZE;
+
+    pthread_mutex_lock(&ring_mutex);
+    unsigned char *frame = ring_frames[ring_head];
+    ring_frames[ring_head] = window_frames[slot];
+    window_frames[slot] = frame;
+    window_frame_sizes[slot] = ring_frame_sizes[ring_head];
+    int payload = ring_payloads[ring_head];
+    ring_head = (ring_head + 1) % RING_SLOTS;
+    ring_count--;
+    pthread_cond_signal(&ring_space);
+    pthread_mutex_unlock(&ring_mutex);
+
+    return sendDataFrame(payload);
+}
 
+//link thread of the pipelined transmitter: sends the frames of the ring while the window has space and handles the
+//acknowledgements, timeouts and retransmissions, until llclose is called and the ring is empty
+void *linkThread(void *arg){
+    while(true){
+        //like writeDataFrame, the acknowledgements that arrived meanwhile are handled before the next frame
+        if(pipelineReady()){
+            if(sendRingFrame() < 0 || waitAcknowledgements(active_window - 1) < 0){
+                break;
+            }
+            continue;
         }
 
-        byte = receiveUnnumberedFrame(UA, true, true);
-
-        if(byte == 0){
-            printf("Connection to receiver completed\n");
-            number_rTransmissions += alarmCount;
-            alarm(0);
-            return 0;
+        pthread_mutex_lock(&ring_mutex);
+        bool empty = ring_count == 0;
+        if(empty && ring_closing){
+            pthread_mutex_unlock(&ring_mutex);
+            return NULL;
+        }
+        if(empty && frame_numb == window_base){
+            //every frame was acknowledged, the line is idle until the application gives the next one
+            ring_waits++;
+            while(ring_count == 0 && !ring_closing){
+                pthread_cond_wait(&ring_ready, &ring_mutex);
+            }
+            pthread_mutex_unlock(&ring_mutex);
+            continue;
         }
+        pthread_mutex_unlock(&ring_mutex);
 
-        else if(byte < 0){
+        //waits for space in the window, or (with the ring empty) until every frame is acknowledged or a new one arrives
+        if(waitAcknowledgements(empty ? 0 : active_window - 1) < 0){
             break;
         }
-        
-
     }
 
-    number_rTransmissions += alarmCount;
-
-    alarm(0);
-    return -1;
+    //the application gets the error in its next llwrite
+    stopTimer(RETRANSMISSION_TIMER);
+    pthread_mutex_lock(&ring_mutex);
+    ring_failed = true;
+    pthread_cond_broadcast(&ring_space);
+    pthread_mutex_unlock(&ring_mutex);
+    return NULL;
 }
 
-//receives the set frame and sends the UA frame in order to connect to the receiver
-int connectToSender(){
+//===================================================================================================== LINK CALIBRATION ========================================================================= 
 
-    if(receiveUnnumberedFrame(SET, false, false) < 0 ){
-        return -1;
+//sends a probe with number tag and probe_size random bytes and waits for its answer. Saves the time from the start
+//of the write to the answer in total_time and from the end of the write in rtt (ms).
+//Returns 0 if the probe arrived intact, 1 if it was lost or corrupted, -1 on error
+int sendProbe(int tag, unsigned char *frame, int probe_size, int *frame_size, long long *total_time, long long *rtt){
+    //the probe data is written in the space after the frame, like llreserve does
+    unsigned char *probe = RESERVED_DATA(frame);
+    for(int i = 0; i < probe_size; i++){
+        probe[i] = rand() & 0xFF;
     }
 
-    if(sendUnnumberedFrame(UA, true) < 0){
+    //a probe is an I frame with another control field
+    *frame_size = createDataFrame(frame, frame_numb, probe, probe_size);
+    frame[2] = C_PROBE(tag);
+    frame[3] = A_SENDER ^ C_PROBE(tag);
+
+    long long start_time = currentTimeMs();
+    if(transportWrite(frame, *frame_size) < 0){
         return -1;
     }
+    transportDrain();
+    long long sent_time = currentTimeMs();
 
-    printf("Connection to the receiver completed\n");
-
-    return 0;
-}
-
-//terminates the connection between the receiver and the transmitter
-int terminate_connection(){
-    
-    //starts the alarm
-    (void)signal(SIGALRM, alarmHandler);
-
-    
-    int byte = 0;
     alarmCount = 0;
-    alarmEnabled = FALSE;
-    state_command = START;
+    startTimer(RETRANSMISSION_TIMER, timeout, alarmHandler);
+    alarmEnabled = TRUE;
 
+    while(alarmEnabled == TRUE){
+        int type = receiveFrame(READ_WAIT_MS);
+        if(type < 0){
+            return -1;
+        }
+        if(type != FRAME_PROBE_OK && type != FRAME_PROBE_BAD){
+            dispatchFrame(type);
+            continue;
+        }
 
+        //the answer to an earlier probe that was taken as lost
+        if(PROBE_TAG(control) != tag){
+            printf("Late answer to a probe ignored\n");
+            continue;
+        }
+        stopTimer(RETRANSMISSION_TIMER);
+        *total_time = currentTimeMs() - start_time;
+        *rtt = currentTimeMs() - sent_time;
+        return type == FRAME_PROBE_BAD ? 1 : 0;
+    }
 
-    //waits timeout time for the disc message. Tries n times to send the message
-    while (alarmCount < nRetransmissions)
-    {
-        if (alarmEnabled == FALSE)
-        {
-            alarm(timeout); // Set alarm to be triggered in timeout seconds
-            alarmEnabled = TRUE;
-            
-            if(sendUnnumberedFrame(DISC, true) != 0){
-                return -1;
-            }
+    //lost probe
+    return 1;
+}
 
-        }
+//measures the link with probes of two sizes and seeds the timeout, the payload size and the window with the results
+int calibrateLink(int baudRate){
+    unsigned char *frame = window_frames[0];
+    long long small_time = 0, large_time = 0;
+    int small_count = 0, large_count = 0, small_frame = 0, large_frame = 0;
+    int failed = 0;
 
-        byte = receiveUnnumberedFrame(DISC, false, true);
+    for(int i = 0; i < CALIBRATION_PROBES; i++){
+        bool small = (i % 2) == 0;
+        int frame_size = 0;
+        long long total_time = 0, rtt = 0;
 
+        int result = sendProbe(i % PROBE_TAGS, frame, small ? SMALL_PROBE_SIZE : MAX_PAYLOAD_SIZE, &frame_size, &total_time, &rtt);
+        if(result < 0){
+            return -1;
+        }
+        if(result > 0){
+            failed++;
+            continue;
+        }
 
-        if(byte == 0){
-            number_rTransmissions += alarmCount;
-            if(sendUnnumberedFrame(UA, false) < 0){
-                return -1;
-            }
-            alarm(0);
-            return 0;
+        updateTimeout(rtt);
+        if(small){
+            small_time += total_time;
+            small_frame = frame_size;
+            small_count++;
+        }
+        else{
+            large_time += total_time;
+            large_frame = frame_size;
+            large_count++;
         }
+    }
 
-        else if(byte < 0){
-            break;
+    if(small_count == 0 || large_count == 0){
+        printf("Link calibration failed, using the default settings\n");
+        return 0;
+    }
+    small_time /= small_count;
+    large_time /= large_count;
+
+    //the extra time of the large probes is the time the line takes for the extra bytes (10 bits each)
+    calibration_rate = baudRate;
+    if(large_time > small_time){
+        long long rate = (long long)(large_frame - small_frame) * 10 * 1000 / (large_time - small_time);
+        if(rate < calibration_rate){
+            calibration_rate = (int) rate;
         }
-        
+    }
+    calibration_delay = (int)(small_time - (long long)small_frame * 10 * 1000 / calibration_rate);
+    if(calibration_delay < 0){
+        calibration_delay = 0;
+    }
+    calibration_error_rate = (double) failed / CALIBRATION_PROBES;
+
+    //payload that maximizes the goodput for the error rate of each byte: sqrt(overhead / byte error rate)
+    double bytes_per_ms = calibration_rate / 10.0 / 1000.0;
+    if(failed > 0){
+        double frame_bytes = (double)(small_frame + large_frame) / 2;
+        double overhead = 16 + calibration_delay * bytes_per_ms; //frame, packet and ack bytes plus the turnaround
+        payload_size = goodputPayload(calibration_error_rate, frame_bytes, overhead);
+    }
+    link_rate = calibration_rate;
 
+    //enough frames to keep the line busy while the first one is acknowledged (delay plus the 5 bytes of the rr)
+    double frame_time = (payload_size + 6) / bytes_per_ms;
+    active_window = 1 + (int) ceil((calibration_delay + 5 / bytes_per_ms) / frame_time);
+    if(active_window > WINDOW_SIZE){
+        active_window = WINDOW_SIZE;
     }
 
-    number_rTransmissions += alarmCount;
-    alarm(0);
-    return -1;
+    calibrated = true;
+    printf("Link calibrated: %d bit/s, %dms round-trip delay, %.0f%% probes lost\n",
+           calibration_rate, calibration_delay, calibration_error_rate * 100);
+    return 0;
 }
 
 //===================================================================================================== MAIN DATA LAYER FUNCTIONS ========================================================================= 
@@ -791,16 +1682,35 @@ int llopen(LinkLayer connectionParameters)
 {
     begin_time = time(NULL);
 
-    int fd = openSerialPort(connectionParameters.serialPort,connectionParameters.baudRate);
+    int fd = transportOpen(connectionParameters.serialPort,connectionParameters.baudRate);
     if (fd < 0)
     {
         perror(connectionParameters.serialPort);
         return -1;
     }
 
+    //the timers and the reception of bytes are handled by the event loop
+    if(eventLoopOpen(fd) < 0){
+        transportClose();
+        return -1;
+    }
+
     role = connectionParameters.role;
     nRetransmissions = connectionParameters.nRetransmissions;
-    timeout = connectionParameters.timeout;
+    timeout = connectionParameters.timeout * 1000;
+
+    //takes the sender window (or the receiver window) from the frame pool
+    if(role == LlTx){
+        for(int i = 0; i < WINDOW_SIZE; i++){
+            window_frames[i] = getPoolFrame();
+        }
+    }
+    else if(SELECTIVE_REPEAT){
+        for(int i = 0; i < WINDOW_SIZE; i++){
+            reorder_frames[i] = getPoolFrame();
+            reorder_present[i] = false;
+        }
+    }
 
     switch(connectionParameters.role){
         case LlTx:
@@ -809,6 +1719,25 @@ int llopen(LinkLayer connectionParameters)
                 printf("Timeout when sending the set frame\n");
                 return -1;
             }
+
+            link_rate = connectionParameters.baudRate;
+            if(CALIBRATION && calibrateLink(connectionParameters.baudRate) < 0){
+                printf("Error while calibrating the link\n");
+                return -1;
+            }
+            recordPayloadSize();
+
+            //from now on the frames are sent by the link thread
+            if(PIPELINE_DEPTH > 0){
+                for(int i = 0; i < PIPELINE_DEPTH; i++){
+                    ring_frames[i] = getPoolFrame();
+                }
+                ring_numb = frame_numb;
+                if(pthread_create(&link_thread, NULL, linkThread, NULL) != 0){
+                    printf("Error while starting the link thread\n");
+                    return -1;
+                }
+            }
             break;
 
         case LlRx:
@@ -832,88 +1761,50 @@ int llopen(LinkLayer connectionParameters)
 int llwrite(const unsigned char *buf, int bufSize)
 {
     //checks if the SIZE of maximum acceptable payload is exceeded
-    if(bufSize > MAX_PAYLOAD_SIZE){
+    if(bufSize > max_info){
         return -1;
     }
 
-    //starts the alarm
-    (void)signal(SIGALRM, alarmHandler);
-
-    alarmCount = 0;
-    alarmEnabled = FALSE;
-
-    //create the frame to send
-    unsigned char *frame = (unsigned char*)malloc(sizeof(unsigned char) * (bufSize * 2 + 6)); //allocate space for the worst case scenario
-    int frame_size = createDataFrame(frame, buf, bufSize);
-
-    //allocate space for the received frame buffer
-    unsigned char *received_frame = (unsigned char*)malloc(sizeof(unsigned char));
-
+    //the pipelined transmitter only builds the frame, the link thread sends it
+    if(PIPELINE_DEPTH > 0){
+        return waitRingSpace() ? pushRingFrame(buf, bufSize) : -1;
+    }
 
-    bool isRej = false;
-    int bytes = 0;
-    state_command = START;
+    return writeDataFrame(buf, bufSize);
+}
 
-    //only exits after completing the data sending
-    while(true){
+////////////////////////////////////////////////
+// LLRESERVE
+////////////////////////////////////////////////
+unsigned char *llreserve(int size)
+{
+    if(role != LlTx || size > max_info){
+        return NULL;
+    }
 
-        //waits timout time for the supervision frame message. Tries n times to send the message
-        while (alarmCount < nRetransmissions)
-        {
-            if (alarmEnabled == FALSE)
-            {
-                alarm(timeout); // Set alarm to be triggered in timeout seconds
-                alarmEnabled = TRUE;
-                
+    //the data goes in the next frame of the ring, once the link thread took the frame there
+    if(PIPELINE_DEPTH > 0){
+        return waitRingSpace() ? RESERVED_DATA(ring_frames[ring_tail]) : NULL;
+    }
 
-                //sends the frame
-                bytes = writeBytesSerialPort(frame, frame_size);
-                printf("%d bytes written\n", bytes);
-                // Wait until all bytes have been written to the serial port
-                sleep(1);
+    //llwrite only returns when the place of the next frame in the window is free
+    return RESERVED_DATA(window_frames[frame_numb % WINDOW_SIZE]);
+}
 
-            }
-            
-            // Returns after 1 char have been input
-            readByteSerialPort(received_frame);
-            
-            //change state depending on the byte received
-            state_machine_RR_REJ(received_frame, &isRej);
-
-            //if the frame received is rej, exit the loop and try again. Else, exit the function and increase the frame counter
-            if(state_command == END){
-                alarm(0);
-                if(isRej){
-                    alarmCount = 0;
-                    alarmEnabled = FALSE;
-                    state_command = START;
-                    number_rTransmissions++;
-                    printf("Frame %d was sent with problems. Trying again\n", frame_numb);
-                    break;
-                }
-                else{
-                    printf("Frame %d sent successfully\n", frame_numb);
-                    frame_numb++;
-                    free(received_frame);
-                    free(frame);
-                    return bytes;
-                }  
-            }
+////////////////////////////////////////////////
+// LLCOMMIT
+////////////////////////////////////////////////
+int llcommit(int size)
+{
+    if(size > max_info){
+        return -1;
+    }
 
-            
-        }
-        if(!isRej){
-            //The transmitter isn't trying to send again because is a timeout
-            break;
-        }
-        isRej = false;
-        alarm(0);//reset the alarm
-        
+    if(PIPELINE_DEPTH > 0){
+        return waitRingSpace() ? pushRingFrame(RESERVED_DATA(ring_frames[ring_tail]), size) : -1;
     }
-    alarm(0);
-    free(frame);
-    free(received_frame);
-    return -1;
+
+    return writeDataFrame(RESERVED_DATA(window_frames[frame_numb % WINDOW_SIZE]), size);
 }
 
 ////////////////////////////////////////////////
@@ -921,171 +1812,225 @@ int llwrite(const unsigned char *buf, int bufSize)
 ////////////////////////////////////////////////
 int llread(unsigned char *packet)
 {
-    int byte_count = 0;
-    //allocate space for the received frame buffer
-    unsigned char *received_frame = (unsigned char*)malloc(sizeof(unsigned char) + 1);
+    const unsigned char *view;
+    int size = llreadview(&view);
+    if(size <= 0){
+        return size;
+    }
+
+    memcpy(packet, view, size);
+    packet[size] = '\0';
+    return size + 2;
+}
 
+////////////////////////////////////////////////
+// LLREADVIEW
+////////////////////////////////////////////////
+int llreadview(const unsigned char **packet)
+{
     bool isRej = false;
-    bool isSpecial = false;
-    bool isDisc = false;
-    bool connectionLost=false;
-    bool isDuplicated = false;
-    int byte = 0;
-    state_frame = START;
+
+    //the transmitter already ended the connection, there is nothing more to read
+    if(disconnected){
+        return 0;
+    }
+
+    //frames that arrived out of order were already acknowledged, deliver them before reading new ones
+    if(pending_first < frame_numb){
+        int slot = pending_first % WINDOW_SIZE;
+        *packet = reorder_frames[slot];
+        reorder_present[slot] = false;
+
+        printf("Frame %d received successfully\n", pending_first);
+        pending_first++;
+        return reorder_frame_sizes[slot];
+    }
 
     //only exits after completing the data receiving
     while(true){
-       
-
-            //The frame was previously rejected so we need to send a supervision frame to warn the transmitter 
-            if(isRej){
-                printf("rej\n");
-                sendSupervisionFrame(&isRej);
-                number_rej++;
-                isRej = false;
-                state_frame = START;
-                byte_count = 0;
-                continue;
-            }
-            
-            byte = readByteSerialPort(received_frame);
 
-        
-            if(byte < 0){
-                printf("something went wrong when reading the data bytes\n");
-                break;
-            }
+        //The frame was previously rejected so we need to send a supervision frame to warn the transmitter 
+        if(isRej){
+            printf("rej\n");
+            sendSupervisionFrame(&isRej);
+            number_rej++;
+            reject_sent = true;
+            isRej = false;
+            continue;
+        }
 
-            //didn't receive any new byte. This may indicate that the connection was lost
-            if(byte == 0){
-                printf("No byte\n");
-                printf("Probably data connection is lost\n");
-                connectionLost = true;
-                continue;
-            }
+        int type = receiveFrame(READ_WAIT_MS);
 
-            //Indicates if an overflow is in risk of happenning. May indicate that the flag was corrupted and the read continued
-            if(byte_count > MAX_PAYLOAD_SIZE + 1){
-                printf("Byte_count = %d\n", byte_count);
-                printf("Warning, risk of overflow, byte_count reseted\n");
-                byte_count = 0;
-                isRej = true;
-                continue;
+        if(type < 0){
+            printf("something went wrong when reading the data bytes\n");
+
+            //the other side of a socketpair, the pipes or a pty closed it, nothing more will arrive
+            if(transportClosed()){
+                printf("The other side closed the connection\n");
+                disconnected = true;
+                return 0;
             }
+            break;
+        }
 
-            state_machine_data_frame(received_frame, &isDisc,&connectionLost, &isDuplicated);
+        //didn't receive any new byte. This may indicate that the connection was lost, so the frame being
+        //received is dropped and the next flag starts a new one
+        if(type == FRAME_NONE){
+            printf("No byte\n");
+            printf("Probably data connection is lost\n");
+            resetFrameParser();
+            continue;
+        }
 
-            //received a duplicated frame. Send a rr to confirm the reception
-            if(isDuplicated){
-                printf("Is Duplicated\n");
-                frame_numb--;
-                isRej = false;
-                if(sendSupervisionFrame(&isRej) < 0){
-                    break;
-                }
-                frame_numb++;
-                continue;
-            }
-            
-            connectionLost=false;
+        //the flag was probably corrupted and the read continued into the next frame
+        if(type == FRAME_TOO_LONG){
+            printf("Warning, risk of overflow, frame dropped\n");
+            isRej = true;
+            continue;
+        }
 
-            
-            //verifies if the the frame is a Disc and activates a flag in order to change the state machine behaviour
-            if(state_frame == A_RCV && *received_frame == C_DISC){
-                isDisc = true;
-                printf("Receiving disc\n");
-            }
+        //the transmitter is ending the connection: sends the disc frame to the sender and receive an UA
+        if(type == FRAME_DISC && parser_address == A_SENDER){
+            printf("Receiving disc\n");
+            sendUnnumberedFrame(DISC, false);
+            receiveUnnumberedFrame(UA, false, false);
+            disconnected = true;
+            return 0;
+        }
 
-            
-            
+        //calibration probe of the transmitter: answers if it arrived intact and waits for the next frame
+        if(type == FRAME_PROBE){
+            sendProbeAnswer(PROBE_TAG(control), parser_intact);
+            continue;
+        }
 
-            //handles the special bytes using the byte stuffing mechanism
-            if(isSpecial){
-                if(*received_frame == (FLAG ^ 0x20)){
-                    
-                    packet[byte_count] = FLAG;
-                    
-                }
-                else{
-                   
-                    packet[byte_count] = ESC;
-                    
-                }
+        if(type != FRAME_I || parser_address != A_SENDER){
+            dispatchFrame(type);
+            continue;
+        }
+
+        //distance between the frame received and the expected one
+        int frame_ahead = ((control >> N_SHIFT) - frame_numb % SEQ_MODULUS + SEQ_MODULUS) % SEQ_MODULUS;
+
+        //received a frame that was already acknowledged. Send a rr to confirm the reception. A duplicate can only be
+        //told apart from a frame after a lost one while the window is at most half of the sequence numbers, with a
+        //bigger Go-Back-N window every frame out of sequence gets the rej of the expected one below
+        bool isDuplicate = frame_ahead != 0 && SEQ_MODULUS - frame_ahead <= WINDOW_SIZE;
+        if(isDuplicate && 2 * WINDOW_SIZE <= SEQ_MODULUS){
+            printf("Is Duplicated\n");
+            if(sendSupervisionFrame(&isRej) < 0){
+                break;
+            }
+            continue;
+        }
 
-                isSpecial = false;
-                byte_count++;
-                continue;
+        //a frame before this one was lost. With Go-Back-N it asks once for the expected frame and the
+        //following ones are discarded. Selective-Repeat keeps the ones inside the window. A frame that can be a
+        //duplicate is answered again when it comes back, the sender may be sending it again because the rej was lost
+        bool isOutOfOrder = frame_ahead != 0;
+        if(isOutOfOrder && !(SELECTIVE_REPEAT && frame_ahead < WINDOW_SIZE)){
+            printf("Frame out of order, expecting frame %d\n", frame_numb);
+            int seq = control >> N_SHIFT;
+            isRej = !reject_sent || (isDuplicate && seq == reject_trigger);
+            if(!reject_sent){
+                reject_trigger = seq;
             }
+            continue;
+        }
 
-            //checks if the byte received is data
-            if((state_frame == DATA)){               
+        //before ending the reception verifies if the data was sent correctly
+        if(!parser_intact){
+            isRej = true;
+            continue;
+        }
 
-                //checks if the byte receivd is a special character from the byte stuffing mechanism
-                if(*received_frame == ESC){
-                    isSpecial = true;
-                }
-                else{
-                    packet[byte_count] = *received_frame;
-                    byte_count++;
-                    
-                }
-                
-                
+        //the data is followed by the frame check sequence
+        int data_size = parser_length - fcsSize(fcs_type);
+
+        //Selective-Repeat: keeps the frame until the missing ones arrive and asks for the expected one
+        if(isOutOfOrder){
+            int slot = (frame_numb + frame_ahead) % WINDOW_SIZE;
+            if(!reorder_present[slot]){
+                memcpy(reorder_frames[slot], receive_buffer, data_size);
+                reorder_frame_sizes[slot] = data_size;
+                reorder_present[slot] = true;
+                reorder_seq[slot] = frame_numb + frame_ahead;
             }
+            printf("Frame %d received out of order, expecting frame %d\n", frame_numb + frame_ahead, frame_numb);
 
-            //if the frame is successfully received, send the rr to confirm an return the number of chars read or a disc frame
-            if(state_frame == END){
-                
-                if(isDisc){
-                    //sends the disc frame to the sender and receive an UA 
-                    sendUnnumberedFrame(DISC, false);
-                    receiveUnnumberedFrame(UA, false, false);
-
-                    free(received_frame);
-                    return 0;
-                    
-                }
+            isRej = !reject_sent;
+            continue;
+        }
 
-                
+        *packet = receive_buffer;
+        
+        printf("Frame %d received successfully\n", frame_numb);
+        frame_numb++;
+        pending_first = frame_numb;
+
+        //the frames kept after this one are acknowledged together and delivered by the next calls
+        bool keptAfterGap = false;
+        if(SELECTIVE_REPEAT){
+            while(reorder_present[frame_numb % WINDOW_SIZE]){
+                frame_numb++;
+            }
+            int kept = 0;
+            for(int i = 0; i < WINDOW_SIZE; i++){
+                kept += reorder_present[i];
+            }
+            keptAfterGap = kept > frame_numb - pending_first;
+        }
 
-                bcc2_control = 0;
-                for(int i = 0; i < byte_count - 1; i++){
-                    bcc2_control ^= packet[i];
-                    
-                }
+        //if there are still frames kept after another gap, a rej asks for the next missing one
+        isRej = keptAfterGap;
+        reject_sent = keptAfterGap;
+        sendSupervisionFrame(&isRej);
+        if(keptAfterGap){
+            number_rej++;
+        }
+        return data_size;
+    }
 
-                //special case when the bcc2 has the same value as the flag wich makes the state machine exit earlier than expected 
-                if(packet[byte_count - 1] == FLAG){
-                     bcc2_control ^= packet[byte_count - 1];
-                     state_command = DATA;
-                }
+    return -1;
+}
 
-                //before ending the reception verifies if the data was sent correctly
-                if(packet[byte_count - 1] != bcc2_control){
-                    isRej = true;
-                    state_command = START;
-                    byte_count = 0;
-                    continue;
-                }
 
-                isRej = false;
-                packet[byte_count - 1] = '\0';
-                
-                printf("Frame %d received successfully\n", frame_numb);
+////////////////////////////////////////////////
+// LLSETRESUME
+////////////////////////////////////////////////
+int llsetresume(const unsigned char *info, int size)
+{
+    if(size < 0 || size > MAX_RESUME_SIZE){
+        return -1;
+    }
 
-                sendSupervisionFrame(&isRej);
-                frame_numb++;
-                free(received_frame);
-                return byte_count + 1;
-                
-        }  
-        
+    if(size > 0){
+        memcpy(resume_info, info, size);
     }
+    resume_size = size;
+    resume_wanted = true;
+    return 0;
+}
 
-    free(received_frame);
-    return -1;
+////////////////////////////////////////////////
+// LLGETRESUME
+////////////////////////////////////////////////
+int llgetresume(unsigned char *info)
+{
+    memcpy(info, resume_info, resume_size);
+    return resume_size;
 }
 
+////////////////////////////////////////////////
+// LLPAYLOADSIZE
+////////////////////////////////////////////////
+int llpayloadsize()
+{
+    pthread_mutex_lock(&payload_mutex);
+    int size = payload_size;
+    pthread_mutex_unlock(&payload_mutex);
+    return size;
+}
 
 ////////////////////////////////////////////////
 // LLCLOSE
@@ -1097,15 +2042,45 @@ int llclose(int showStatistics)
     double time_spent = (double)(end_time - begin_time);
 
     if(role == LlTx){
+        //the link thread sends the frames still in the ring and stops
+        if(PIPELINE_DEPTH > 0){
+            pthread_mutex_lock(&ring_mutex);
+            ring_closing = true;
+            pthread_cond_signal(&ring_ready);
+            pthread_mutex_unlock(&ring_mutex);
+            eventLoopWake();
+            pthread_join(link_thread, NULL);
+
+            for(int i = 0; i < PIPELINE_DEPTH; i++){
+                putPoolFrame(ring_frames[i]);
+            }
+        }
+
+        //waits for the acknowledgement of the frames still in the window
+        if(waitAcknowledgements(0) < 0){
+            printf("Some frames were not acknowledged\n");
+        }
+        stopTimer(RETRANSMISSION_TIMER);
+
+        for(int i = 0; i < WINDOW_SIZE; i++){
+            putPoolFrame(window_frames[i]);
+        }
+
         if(terminate_connection() < 0){
             return -1;
         }
     }
     else{
-        //if is receiver, call the llread to receive a disc and send a disc to the transmitter
-        unsigned char *packet = (unsigned char*)malloc(sizeof(unsigned char) * MAX_PAYLOAD_SIZE);
-        llread(packet);
-        free(packet);
+        //if is receiver, call the llread to receive a disc and send a disc to the transmitter (the application
+        //may have read it already, waiting for another file)
+        const unsigned char *packet;
+        llreadview(&packet);
+
+        if(SELECTIVE_REPEAT){
+            for(int i = 0; i < WINDOW_SIZE; i++){
+                putPoolFrame(reorder_frames[i]);
+            }
+        }
     }
 
     if(showStatistics){
@@ -1117,13 +2092,54 @@ int llclose(int showStatistics)
             printf("Number of timeouts = %d\n", number_timeouts);
             printf("Number of retransmissions = %d\n", number_rTransmissions);
             printf("Data frames sent successfully = %d\n", frame_numb - 1);
+            if(calibrated){
+                printf("Calibrated bit rate = %d bit/s\n", calibration_rate);
+                printf("Calibrated round-trip delay = %dms\n", calibration_delay);
+                printf("Calibration probes lost or corrupted = %.0f%%\n", calibration_error_rate * 100);
+                printf("Payload size = %d bytes, window = %d frames\n", payload_size, active_window);
+            }
+            if(ADAPTIVE_TIMEOUT && srtt >= 0){
+                printf("Smoothed round-trip time = %dms (variation %dms)\n", srtt, rttvar);
+                printf("Retransmission timeout = %dms\n", timeout);
+            }
+            if(frame_numb > 0){
+                printf("Average payload size = %lld bytes\n", payload_bytes / frame_numb);
+            }
+            if(PIPELINE_DEPTH > 0){
+                printf("Pipeline: ring of %d frames, link idle waiting for the application %d times\n", PIPELINE_DEPTH,
+                       ring_waits);
+            }
+            if(ADAPTIVE_PAYLOAD){
+                printf("Payload size over time (from frame: bytes) =");
+                for(int i = 0; i < payload_history_length; i++){
+                    printf(" %d: %d", payload_history_frame[i], payload_history_size[i]);
+                }
+                printf("\n");
+            }
         }
         else{
             printf("Frames rejected = %d\n", number_rej);
+            if(BLOCK_ACK){
+                printf("Block acknowledgements sent = %d\n", number_sack);
+            }
             printf("Data frames received successfully = %d\n", frame_numb - 1);
         }
+
+        if(fcs_type == FCS_CRC32C){
+            printf("Frame check sequence = %s (%s)\n", fcsName(fcs_type), crc32cKernel());
+        }
+        else{
+            printf("Frame check sequence = %s\n", fcsName(fcs_type));
+        }
+        printf("Maximum information field = %d bytes\n", max_info);
+        printf("Byte stuffing = %s\n", stuffingKernel());
+        printf("Frame pool: %d of %d frames in use at most, %d taken, %d failures\n", pool_peak, POOL_FRAMES,
+               pool_gets, pool_failures);
+        printf("Read system calls = %d (%.2f per data frame)\n", number_read_calls,
+               frame_numb > 0 ? (double) number_read_calls / frame_numb : 0.0);
     }
 
-    int clstat = closeSerialPort();
+    eventLoopClose();
+    int clstat = transportClose();
     return clstat;
 }
@@ -0,0 +1,126 @@
+// Serial line implementation
+
+#include "serial_line.h"
+#include "serial_port.h"
+
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// Read policy of the serial port (non-canonical mode).
+// VMIN = 0: a read returns as soon as any byte is available or after VTIME
+// tenths of a second without bytes. VMIN > 0 makes a read block until the first
+// byte arrives, so the link layer timeouts only work with VMIN = 0.
+#ifndef SERIAL_VMIN
+#define SERIAL_VMIN 0
+#endif
+
+#ifndef SERIAL_VTIME
+#define SERIAL_VTIME 1
+#endif
+
+static int fd = -1;              // File descriptor of the open serial port
+static int baudRateBps = 0;      // Baud rate of the open serial port
+static long long lineIdleAtUs = 0; // Monotonic time (us) when the bytes written have left the line
+
+// Current time of the monotonic clock in microseconds.
+static long long monotonicUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int openSerialLine(const char *serialPort, int baudRate)
+{
+    fd = openSerialPort(serialPort, baudRate);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    baudRateBps = baudRate;
+    lineIdleAtUs = 0;
+
+    // openSerialPort sets VMIN = 0 and VTIME = 1
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == -1)
+    {
+        perror("tcgetattr");
+        closeSerialPort();
+        return -1;
+    }
+    tio.c_cc[VTIME] = SERIAL_VTIME; // Block reading
+    tio.c_cc[VMIN] = SERIAL_VMIN;   // Return with the bytes available
+    if (tcsetattr(fd, TCSANOW, &tio) == -1)
+    {
+        perror("tcsetattr");
+        closeSerialPort();
+        return -1;
+    }
+
+    return fd;
+}
+
+int closeSerialLine()
+{
+    fd = -1;
+    return closeSerialPort();
+}
+
+int readSerialLine(unsigned char *bytes, int numBytes)
+{
+    return read(fd, bytes, numBytes);
+}
+
+int writeSerialLine(const unsigned char *bytes, int numBytes)
+{
+    int written = writeBytesSerialPort(bytes, numBytes);
+
+    // The line sends the new bytes after the ones still being sent
+    // (10 bits per byte: start, 8 data bits and stop)
+    if (written > 0)
+    {
+        long long now = monotonicUs();
+        if (lineIdleAtUs < now)
+        {
+            lineIdleAtUs = now;
+        }
+        lineIdleAtUs += (long long)written * 10 * 1000000 / baudRateBps;
+    }
+
+    return written;
+}
+
+// The wait is computed from the baud rate and the bytes written, since some
+// drivers (ptys, USB adapters) report an empty queue while the bytes are still
+// on their way, and then from the bytes the driver still has in its queue.
+int drainSerialLine()
+{
+    long long remainingUs = lineIdleAtUs - monotonicUs();
+    if (remainingUs > 0)
+    {
+        usleep((useconds_t)remainingUs);
+    }
+
+    int queued = 0;
+    if (ioctl(fd, TIOCOUTQ, &queued) == -1)
+    {
+        // The driver can't report the queue size
+        return tcdrain(fd);
+    }
+
+    while (queued > 0)
+    {
+        usleep((useconds_t)((long long)queued * 10 * 1000000 / baudRateBps));
+
+        if (ioctl(fd, TIOCOUTQ, &queued) == -1)
+        {
+            perror("ioctl");
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,414 @@
+// Byte stuffing implementation
+
+#include "stuffing.h"
+#include "fcs.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define STUFFING_FLAG 0x7E
+#define STUFFING_ESC 0x7D
+
+// The frame check sequence is computed on blocks of this size right before
+// they are stuffed, while they are still in the cache.
+#define STUFFING_BLOCK 512
+
+// Stuffs size bytes of src into dst and xors them into bcc2. Returns the number of bytes written.
+typedef int (*StuffingKernel)(unsigned char *dst, const unsigned char *src, int size, unsigned char *bcc2);
+
+// Destuffs src into dst up to a flag byte. Returns the number of bytes of src consumed.
+typedef int (*DestuffingKernel)(unsigned char *dst, int dstSize, const unsigned char *src, int size, int *written, int *escaped);
+
+static StuffingKernel stuffingImpl = NULL;
+static DestuffingKernel destuffingImpl = NULL;
+static const char *stuffingImplName = "";
+
+// Scalar kernel, also used for the tail of the SIMD kernels.
+static int stuffScalar(unsigned char *dst, const unsigned char *src, int size, unsigned char *bcc2)
+{
+    int out = 0;
+    unsigned char xor = 0;
+    for (int i = 0; i < size; i++)
+    {
+        xor ^= src[i];
+        if (src[i] == STUFFING_FLAG || src[i] == STUFFING_ESC)
+        {
+            dst[out++] = STUFFING_ESC;
+            dst[out++] = src[i] ^ 0x20;
+        }
+        else
+        {
+            dst[out++] = src[i];
+        }
+    }
+
+    *bcc2 ^= xor;
+    return out;
+}
+
+// Scalar destuffing kernel, also used for the tail of the SIMD kernels.
+static int destuffScalar(unsigned char *dst, int dstSize, const unsigned char *src, int size, int *written, int *escaped)
+{
+    int in = 0;
+    int out = 0;
+    while (in < size && out < dstSize && src[in] != STUFFING_FLAG)
+    {
+        if (*escaped)
+        {
+            dst[out++] = src[in] ^ 0x20;
+            *escaped = 0;
+        }
+        else if (src[in] == STUFFING_ESC)
+        {
+            *escaped = 1;
+        }
+        else
+        {
+            dst[out++] = src[in];
+        }
+        in++;
+    }
+
+    *written = out;
+    return in;
+}
+
+#if defined(__x86_64__)
+// 32 bytes of 0xFF followed by 32 zeros. Loading from (32 - n) gives a mask
+// of the first n bytes of a vector.
+static const unsigned char prefixMask[64] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+// SSE2 kernel. A block of 16 bytes without special bytes is copied at once.
+// Otherwise the whole block is stored, the clean run before the first special
+// byte is kept and the special byte is escaped. The stores never go past
+// 2 * size bytes of dst.
+static int stuffSse2(unsigned char *dst, const unsigned char *src, int size, unsigned char *bcc2)
+{
+    const __m128i flag = _mm_set1_epi8(STUFFING_FLAG);
+    const __m128i esc = _mm_set1_epi8(STUFFING_ESC);
+    __m128i xor = _mm_setzero_si128();
+    int out = 0;
+    int i = 0;
+
+    while (i + 16 <= size)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(block, flag), _mm_cmpeq_epi8(block, esc));
+        int mask = _mm_movemask_epi8(special);
+        _mm_storeu_si128((__m128i *)(dst + out), block);
+
+        if (mask == 0)
+        {
+            xor = _mm_xor_si128(xor, block);
+            out += 16;
+            i += 16;
+            continue;
+        }
+
+        // Only the bytes up to the special one are consumed
+        int run = __builtin_ctz(mask);
+        __m128i consumed = _mm_loadu_si128((const __m128i *)(prefixMask + 32 - (run + 1)));
+        xor = _mm_xor_si128(xor, _mm_and_si128(block, consumed));
+
+        out += run;
+        dst[out++] = STUFFING_ESC;
+        dst[out++] = src[i + run] ^ 0x20;
+        i += run + 1;
+    }
+
+    unsigned char bytes[16];
+    _mm_storeu_si128((__m128i *)bytes, xor);
+    for (int k = 0; k < 16; k++)
+    {
+        *bcc2 ^= bytes[k];
+    }
+
+    return out + stuffScalar(dst + out, src + i, size - i, bcc2);
+}
+
+// AVX2 kernel, the same as the SSE2 one with blocks of 32 bytes.
+__attribute__((target("avx2")))
+static int stuffAvx2(unsigned char *dst, const unsigned char *src, int size, unsigned char *bcc2)
+{
+    const __m256i flag = _mm256_set1_epi8(STUFFING_FLAG);
+    const __m256i esc = _mm256_set1_epi8(STUFFING_ESC);
+    __m256i xor = _mm256_setzero_si256();
+    int out = 0;
+    int i = 0;
+
+    while (i + 32 <= size)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(block, flag), _mm256_cmpeq_epi8(block, esc));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(special);
+        _mm256_storeu_si256((__m256i *)(dst + out), block);
+
+        if (mask == 0)
+        {
+            xor = _mm256_xor_si256(xor, block);
+            out += 32;
+            i += 32;
+            continue;
+        }
+
+        // Only the bytes up to the special one are consumed
+        int run = __builtin_ctz(mask);
+        __m256i consumed = _mm256_loadu_si256((const __m256i *)(prefixMask + 32 - (run + 1)));
+        xor = _mm256_xor_si256(xor, _mm256_and_si256(block, consumed));
+
+        out += run;
+        dst[out++] = STUFFING_ESC;
+        dst[out++] = src[i + run] ^ 0x20;
+        i += run + 1;
+    }
+
+    unsigned char bytes[32];
+    _mm256_storeu_si256((__m256i *)bytes, xor);
+    for (int k = 0; k < 32; k++)
+    {
+        *bcc2 ^= bytes[k];
+    }
+
+    // Avoids the AVX to SSE transition penalty in the SSE2 kernel used for the tail
+    _mm256_zeroupper();
+    return out + stuffSse2(dst + out, src + i, size - i, bcc2);
+}
+
+// SSE2 destuffing kernel. Blocks of 16 bytes without special bytes are copied
+// at once, a special byte ends the run before it. Only stores inside dstSize.
+static int destuffSse2(unsigned char *dst, int dstSize, const unsigned char *src, int size, int *written, int *escaped)
+{
+    const __m128i flag = _mm_set1_epi8(STUFFING_FLAG);
+    const __m128i esc = _mm_set1_epi8(STUFFING_ESC);
+    int in = 0;
+    int out = 0;
+
+    while (true)
+    {
+        if (*escaped)
+        {
+            // The byte after the escape byte
+            if (in == size || out == dstSize || src[in] == STUFFING_FLAG)
+            {
+                break;
+            }
+            dst[out++] = src[in++] ^ 0x20;
+            *escaped = 0;
+        }
+
+        if (in + 16 > size || out + 16 > dstSize)
+        {
+            break;
+        }
+
+        __m128i block = _mm_loadu_si128((const __m128i *)(src + in));
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(block, flag), _mm_cmpeq_epi8(block, esc));
+        int mask = _mm_movemask_epi8(special);
+        _mm_storeu_si128((__m128i *)(dst + out), block);
+
+        if (mask == 0)
+        {
+            in += 16;
+            out += 16;
+            continue;
+        }
+
+        int run = __builtin_ctz(mask);
+        in += run;
+        out += run;
+        if (src[in] == STUFFING_FLAG)
+        {
+            *written = out;
+            return in;
+        }
+        in++;
+        *escaped = 1;
+    }
+
+    int tail = 0;
+    in += destuffScalar(dst + out, dstSize - out, src + in, size - in, &tail, escaped);
+    *written = out + tail;
+    return in;
+}
+
+// AVX2 destuffing kernel, the same as the SSE2 one with blocks of 32 bytes.
+__attribute__((target("avx2")))
+static int destuffAvx2(unsigned char *dst, int dstSize, const unsigned char *src, int size, int *written, int *escaped)
+{
+    const __m256i flag = _mm256_set1_epi8(STUFFING_FLAG);
+    const __m256i esc = _mm256_set1_epi8(STUFFING_ESC);
+    int in = 0;
+    int out = 0;
+
+    while (true)
+    {
+        if (*escaped)
+        {
+            // The byte after the escape byte
+            if (in == size || out == dstSize || src[in] == STUFFING_FLAG)
+            {
+                break;
+            }
+            dst[out++] = src[in++] ^ 0x20;
+            *escaped = 0;
+        }
+
+        if (in + 32 > size || out + 32 > dstSize)
+        {
+            break;
+        }
+
+        __m256i block = _mm256_loadu_si256((const __m256i *)(src + in));
+        __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(block, flag), _mm256_cmpeq_epi8(block, esc));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(special);
+        _mm256_storeu_si256((__m256i *)(dst + out), block);
+
+        if (mask == 0)
+        {
+            in += 32;
+            out += 32;
+            continue;
+        }
+
+        int run = __builtin_ctz(mask);
+        in += run;
+        out += run;
+        if (src[in] == STUFFING_FLAG)
+        {
+            _mm256_zeroupper();
+            *written = out;
+            return in;
+        }
+        in++;
+        *escaped = 1;
+    }
+
+    // Avoids the AVX to SSE transition penalty in the SSE2 kernel used for the tail
+    _mm256_zeroupper();
+    int tail = 0;
+    in += destuffSse2(dst + out, dstSize - out, src + in, size - in, &tail, escaped);
+    *written = out + tail;
+    return in;
+}
+#endif
+
+// Choose the widest kernels that the CPU supports.
+static void selectStuffingKernel()
+{
+    stuffingImpl = stuffScalar;
+    destuffingImpl = destuffScalar;
+    stuffingImplName = "scalar";
+
+#if defined(__x86_64__)
+    // SSE2 is part of x86-64
+    stuffingImpl = stuffSse2;
+    destuffingImpl = destuffSse2;
+    stuffingImplName = "sse2";
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        stuffingImpl = stuffAvx2;
+        destuffingImpl = destuffAvx2;
+        stuffingImplName = "avx2";
+    }
+#endif
+}
+
+// Use the kernels called name if the CPU supports them.
+int useStuffingKernel(const char *name)
+{
+    if (strcmp(name, "scalar") == 0)
+    {
+        stuffingImpl = stuffScalar;
+        destuffingImpl = destuffScalar;
+        stuffingImplName = "scalar";
+        return 0;
+    }
+
+#if defined(__x86_64__)
+    if (strcmp(name, "sse2") == 0)
+    {
+        stuffingImpl = stuffSse2;
+        destuffingImpl = destuffSse2;
+        stuffingImplName = "sse2";
+        return 0;
+    }
+
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+    {
+        stuffingImpl = stuffAvx2;
+        destuffingImpl = destuffAvx2;
+        stuffingImplName = "avx2";
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
+// Copy size bytes of src to dst with byte stuffing and compute the frame check sequence in the same pass.
+int stuffData(unsigned char *dst, const unsigned char *src, int size, int fcsType, unsigned char *fcs)
+{
+    if (stuffingImpl == NULL)
+    {
+        selectStuffingKernel();
+    }
+
+    int out = 0;
+    unsigned char bcc2 = 0;
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (int i = 0; i < size; i += STUFFING_BLOCK)
+    {
+        int length = size - i < STUFFING_BLOCK ? size - i : STUFFING_BLOCK;
+        if (fcsType == FCS_CRC32C)
+        {
+            crc = crc32cUpdate(crc, src + i, length);
+        }
+        out += stuffingImpl(dst + out, src + i, length, &bcc2);
+    }
+
+    if (fcsType == FCS_CRC32C)
+    {
+        crc = ~crc;
+        fcs[0] = crc & 0xFF;
+        fcs[1] = (crc >> 8) & 0xFF;
+        fcs[2] = (crc >> 16) & 0xFF;
+        fcs[3] = (crc >> 24) & 0xFF;
+    }
+    else
+    {
+        fcs[0] = bcc2;
+    }
+
+    return out;
+}
+
+// Name of the stuffing kernel chosen for this CPU.
+const char *stuffingKernel()
+{
+    if (stuffingImpl == NULL)
+    {
+        selectStuffingKernel();
+    }
+
+    return stuffingImplName;
+}
+
+// Copy src to dst undoing the byte stuffing, until a flag byte, the end of src or dstSize bytes written.
+int destuffData(unsigned char *dst, int dstSize, const unsigned char *src, int size, int *written, int *escaped)
+{
+    if (destuffingImpl == NULL)
+    {
+        selectStuffingKernel();
+    }
+
+    return destuffingImpl(dst, dstSize, src, size, written, escaped);
+}
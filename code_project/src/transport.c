@@ -0,0 +1,304 @@
+// Transport implementation
+
+#define _GNU_SOURCE // posix_openpt, ptsname
+
+#include "transport.h"
+#include "serial_line.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Operations of a transport.
+typedef struct
+{
+    const char *prefix; // Of the port string (like "pty:"), the rest is given to open
+    int (*open)(const char *path, int baudRate); // Returns the fd to wait for bytes, -1 on error
+    int (*close)();
+    int (*read)(unsigned char *bytes, int numBytes);
+    int (*write)(const unsigned char *bytes, int numBytes);
+    int (*drain)();
+    int (*closed)(); // The other side closed its end for good
+} Transport;
+
+static int readFd = -1;
+static int writeFd = -1;
+static int streamClosed = 0; // The other side closed its end
+
+// pty: the side that created the pair
+static int ptyKeepFd = -1; // Its own slave, kept open
+static char ptyLink[256] = "";
+
+// Read the bytes available (the fd is non-blocking, the link layer waits for
+// them with epoll). The other side closing its end is an error, it can't come
+// back like an unplugged cable.
+static int streamRead(unsigned char *bytes, int numBytes)
+{
+    int res = read(readFd, bytes, numBytes);
+    if (res == -1 && (errno == EAGAIN || errno == EINTR))
+    {
+        return 0;
+    }
+    if (res == 0 || (res == -1 && errno == EIO))
+    {
+        streamClosed = 1;
+        errno = EPIPE;
+        return -1;
+    }
+    return res;
+}
+
+// Write all the bytes, waiting for room while the other side reads.
+static int streamWrite(const unsigned char *bytes, int numBytes)
+{
+    int written = 0;
+    while (written < numBytes)
+    {
+        int res = write(writeFd, bytes + written, numBytes - written);
+        if (res > 0)
+        {
+            written += res;
+        }
+        else if (res == -1 && errno == EAGAIN)
+        {
+            struct pollfd pfd = {writeFd, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+        }
+        else if (res == -1 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return written;
+}
+
+// Nothing to wait for: the bytes are in the other side as soon as they are written.
+static int streamDrain()
+{
+    return 0;
+}
+
+static int streamIsClosed()
+{
+    return streamClosed;
+}
+
+static int streamClose()
+{
+    int result = close(readFd);
+    if (writeFd != readFd && close(writeFd) == -1)
+    {
+        result = -1;
+    }
+    readFd = -1;
+    writeFd = -1;
+    return result;
+}
+
+// Use the descriptors given by the program that started both sides.
+static int useStream(int rfd, int wfd)
+{
+    if (fcntl(rfd, F_SETFL, fcntl(rfd, F_GETFL) | O_NONBLOCK) == -1 ||
+        fcntl(wfd, F_SETFL, fcntl(wfd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+        perror("fcntl");
+        return -1;
+    }
+
+    // A write after the other side closed fails instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+    readFd = rfd;
+    writeFd = wfd;
+    streamClosed = 0;
+    return rfd;
+}
+
+// Parse a file descriptor number, ending at end.
+static int parseFd(const char *text, char end, const char **next)
+{
+    char *stop;
+    long value = strtol(text, &stop, 10);
+    if (stop == text || *stop != end || value < 0 || value > 65535)
+    {
+        return -1;
+    }
+    *next = stop + (end != '\0');
+    return value;
+}
+
+// No echo, no line editing and no translation of the bytes.
+static int makeRaw(int fd)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == -1)
+    {
+        return -1;
+    }
+    cfmakeraw(&tio);
+    return tcsetattr(fd, TCSANOW, &tio);
+}
+
+static int ptyOpen(const char *path, int baudRate)
+{
+    struct stat info;
+    while (lstat(path, &info) == -1)
+    {
+        // First side: create the pair
+        int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+        {
+            perror("posix_openpt");
+            return -1;
+        }
+        const char *slave = ptsname(master);
+
+        // Reads of the master fail while no slave is open, so this side keeps one
+        ptyKeepFd = open(slave, O_RDWR | O_NOCTTY);
+        if (ptyKeepFd == -1 || makeRaw(ptyKeepFd) == -1)
+        {
+            perror(slave);
+            close(master);
+            return -1;
+        }
+
+        if (symlink(slave, path) == 0)
+        {
+            snprintf(ptyLink, sizeof(ptyLink), "%s", path);
+            readFd = master;
+            writeFd = master;
+            streamClosed = 0;
+            return master;
+        }
+
+        // The other side created its pair meanwhile
+        int error = errno;
+        close(ptyKeepFd);
+        close(master);
+        ptyKeepFd = -1;
+        if (error != EEXIST)
+        {
+            errno = error;
+            perror(path);
+            return -1;
+        }
+    }
+
+    int slave = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (slave == -1 && errno == ENOENT && S_ISLNK(info.st_mode))
+    {
+        // Left by a side that didn't close: create a new pair
+        unlink(path);
+        return ptyOpen(path, baudRate);
+    }
+    if (slave == -1 || makeRaw(slave) == -1)
+    {
+        perror(path);
+        return -1;
+    }
+    readFd = slave;
+    writeFd = slave;
+    streamClosed = 0;
+    return slave;
+}
+
+static int ptyClose()
+{
+    if (ptyKeepFd != -1)
+    {
+        close(ptyKeepFd);
+        ptyKeepFd = -1;
+        unlink(ptyLink);
+        ptyLink[0] = '\0';
+    }
+    return streamClose();
+}
+
+static int socketpairOpen(const char *path, int baudRate)
+{
+    const char *next;
+    int sfd = parseFd(path, '\0', &next);
+    if (sfd == -1)
+    {
+        fprintf(stderr, "socketpair: expected socketpair:FD, got %s\n", path);
+        return -1;
+    }
+    return useStream(sfd, sfd);
+}
+
+static int pipeOpen(const char *path, int baudRate)
+{
+    const char *next;
+    int rfd = parseFd(path, ',', &next);
+    int wfd = rfd == -1 ? -1 : parseFd(next, '\0', &next);
+    if (wfd == -1)
+    {
+        fprintf(stderr, "pipe: expected pipe:RFD,WFD, got %s\n", path);
+        return -1;
+    }
+    return useStream(rfd, wfd);
+}
+
+// An unplugged cable can come back, a serial port is never closed by the other side.
+static int serialIsClosed()
+{
+    return 0;
+}
+
+static const Transport ptyTransport = {"pty:", ptyOpen, ptyClose, streamRead, streamWrite, streamDrain,
+                                       streamIsClosed};
+static const Transport socketpairTransport = {"socketpair:", socketpairOpen, streamClose, streamRead, streamWrite,
+                                              streamDrain, streamIsClosed};
+static const Transport pipeTransport = {"pipe:", pipeOpen, streamClose, streamRead, streamWrite, streamDrain,
+                                        streamIsClosed};
+static const Transport serialTransport = {"", openSerialLine, closeSerialLine, readSerialLine, writeSerialLine,
+                                          drainSerialLine, serialIsClosed};
+
+// The serial port is the last one, its empty prefix takes any port
+static const Transport *transports[] = {&ptyTransport, &socketpairTransport, &pipeTransport, &serialTransport};
+
+static const Transport *transport = &serialTransport;
+
+int transportOpen(const char *port, int baudRate)
+{
+    for (int i = 0; i < (int)(sizeof(transports) / sizeof(transports[0])); i++)
+    {
+        transport = transports[i];
+        if (strncmp(port, transport->prefix, strlen(transport->prefix)) == 0)
+        {
+            break;
+        }
+    }
+    return transport->open(port + strlen(transport->prefix), baudRate);
+}
+
+int transportClose()
+{
+    return transport->close();
+}
+
+int transportRead(unsigned char *bytes, int numBytes)
+{
+    return transport->read(bytes, numBytes);
+}
+
+int transportWrite(const unsigned char *bytes, int numBytes)
+{
+    return transport->write(bytes, numBytes);
+}
+
+int transportDrain()
+{
+    return transport->drain();
+}
+
+int transportClosed()
+{
+    return transport->closed();
+}
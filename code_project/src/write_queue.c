@@ -0,0 +1,142 @@
+// Write queue implementation
+
+#include "write_queue.h"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define WRITE_QUEUE_SPINS 1000 // Loads of the other side's index before sleeping
+
+int writeQueueInit(WriteQueue *queue, int slots, int blockSize)
+{
+    queue->data = malloc((size_t)slots * blockSize);
+    queue->blocks = malloc(sizeof(WriteBlock) * slots);
+    if (queue->data == NULL || queue->blocks == NULL)
+    {
+        writeQueueFree(queue);
+        return -1;
+    }
+    queue->slots = slots;
+    queue->blockSize = blockSize;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->producerWaiting, 0);
+    atomic_init(&queue->consumerWaiting, 0);
+
+    queue->maxDepth = 0;
+    queue->depthSum = 0;
+    queue->pushes = 0;
+    queue->fullWaits = 0;
+    return 0;
+}
+
+void writeQueueFree(WriteQueue *queue)
+{
+    free(queue->data);
+    free(queue->blocks);
+    queue->data = NULL;
+    queue->blocks = NULL;
+}
+
+// Wait until the index of the other side isn't seen any more: spin first, then
+// sleep on its futex with the waiting flag set. The flag is set before the
+// index is checked again, and the other side stores the index before it
+// checks the flag (both sequentially consistent), so either this side sees the
+// new index or the other side sees the flag and wakes it.
+static void waitWhile(atomic_uint *index, unsigned int seen, atomic_int *waiting)
+{
+    for (int i = 0; i < WRITE_QUEUE_SPINS; i++)
+    {
+        if (atomic_load_explicit(index, memory_order_acquire) != seen)
+        {
+            return;
+        }
+    }
+
+    atomic_store(waiting, 1);
+    while (atomic_load(index) == seen)
+    {
+        // Returns at once if the index is not seen any more, or when woken (or interrupted)
+        syscall(SYS_futex, index, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    }
+    atomic_store_explicit(waiting, 0, memory_order_relaxed);
+}
+
+// Blocks in the queue. The indexes count up to twice the slots, so a full
+// queue (slots blocks) is told apart from an empty one for any number of slots.
+static unsigned int depthOf(const WriteQueue *queue, unsigned int head, unsigned int tail)
+{
+    return (tail + 2 * queue->slots - head) % (2 * queue->slots);
+}
+
+// Index after index.
+static unsigned int nextIndex(const WriteQueue *queue, unsigned int index)
+{
+    return (index + 1) % (2 * queue->slots);
+}
+
+// Move the index of this side, and wake the other side if it sleeps on it.
+static void advance(atomic_uint *index, unsigned int value, atomic_int *waiting)
+{
+    atomic_store(index, value);
+    if (atomic_load(waiting))
+    {
+        syscall(SYS_futex, index, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+unsigned char *writeQueueReserve(WriteQueue *queue)
+{
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (depthOf(queue, head, tail) == (unsigned int)queue->slots)
+    {
+        queue->fullWaits++;
+        waitWhile(&queue->head, head, &queue->producerWaiting);
+    }
+    return queue->data + (size_t)(tail % queue->slots) * queue->blockSize;
+}
+
+void writeQueuePush(WriteQueue *queue, long offset, int size, int tag)
+{
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    WriteBlock *block = &queue->blocks[tail % queue->slots];
+    block->offset = offset;
+    block->size = size;
+    block->tag = tag;
+
+    // The block (and its data) is visible to the consumer before the new tail
+    tail = nextIndex(queue, tail);
+    advance(&queue->tail, tail, &queue->consumerWaiting);
+
+    int depth = depthOf(queue, atomic_load_explicit(&queue->head, memory_order_acquire), tail);
+    if (depth > queue->maxDepth)
+    {
+        queue->maxDepth = depth;
+    }
+    queue->depthSum += depth;
+    queue->pushes++;
+}
+
+const unsigned char *writeQueuePeek(WriteQueue *queue, WriteBlock *block)
+{
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (atomic_load_explicit(&queue->tail, memory_order_acquire) == head)
+    {
+        waitWhile(&queue->tail, head, &queue->consumerWaiting);
+    }
+
+    int slot = head % queue->slots;
+    *block = queue->blocks[slot];
+    return queue->data + (size_t)slot * queue->blockSize;
+}
+
+void writeQueuePop(WriteQueue *queue)
+{
+    // The slot is only reused by the producer after the consumer is done with it
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    advance(&queue->head, nextIndex(queue, head), &queue->producerWaiting);
+}
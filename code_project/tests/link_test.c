@@ -0,0 +1,318 @@
+// Link test: runs a transmitter and a receiver (bin/main) connected through a
+// relay, like the virtual cable, and checks the file received.
+//
+// Usage: link_test [options] main file
+//   -t socketpair|pipe  transport between the relay and each side (default socketpair)
+//   -e rate             probability of a bit flip in each byte (default 0)
+//   -s seed             of the bit flips (default 1)
+//   -b baud             line rate of the relay, 0 for memory speed (default 0)
+//   -l seconds          time limit of the transfer (default 120)
+// Exits with 0 when both sides exit with 0 and the file received is the file sent.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RELAY_CHUNK 4096
+
+// One direction of the relay.
+typedef struct
+{
+    int in; // Relay end of the side that writes
+    int out; // Relay end of the side that reads
+    double budget; // Bytes the line can carry now (with a baud rate)
+} Direction;
+
+static double errorRate = 0;
+static unsigned long long rngState = 1;
+
+static double monotonicSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, the same bit flips for the same seed on every machine.
+static double nextRandom()
+{
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return (double)((rngState * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+// Start bin/main with the port, the role and the file. The relay ends and the
+// ends of the other side are closed in the child.
+static pid_t startSide(const char *main, const char *port, const char *role, const char *file,
+                       const char *log, int keep[2], int fds[], int count)
+{
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        return pid;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (fds[i] != keep[0] && fds[i] != keep[1])
+        {
+            close(fds[i]);
+        }
+    }
+    int output = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output != -1)
+    {
+        dup2(output, STDOUT_FILENO);
+        dup2(output, STDERR_FILENO);
+        close(output);
+    }
+    execl(main, main, port, "115200", role, file, (char *)NULL);
+    perror(main);
+    _exit(127);
+}
+
+// Move the bytes waiting in one direction, flipping bits with errorRate.
+// Returns -1 when the side that writes closed its end.
+static int relay(Direction *direction, int paced)
+{
+    unsigned char bytes[RELAY_CHUNK];
+    int size = sizeof(bytes);
+    if (paced && direction->budget < size)
+    {
+        size = (int)direction->budget;
+    }
+    if (size <= 0)
+    {
+        return 0;
+    }
+
+    int res = read(direction->in, bytes, size);
+    if (res == -1 && (errno == EAGAIN || errno == EINTR))
+    {
+        return 0;
+    }
+    if (res <= 0)
+    {
+        return -1;
+    }
+    direction->budget -= res;
+
+    for (int i = 0; i < res && errorRate > 0; i++)
+    {
+        if (nextRandom() < errorRate)
+        {
+            bytes[i] ^= 1 << (int)(nextRandom() * 8);
+        }
+    }
+
+    // The side that reads may have exited already, its bytes are dropped then
+    for (int written = 0; written < res;)
+    {
+        int n = write(direction->out, bytes + written, res - written);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+static int sameFiles(const char *a, const char *b)
+{
+    FILE *fa = fopen(a, "rb");
+    FILE *fb = fopen(b, "rb");
+    int same = fa != NULL && fb != NULL;
+    while (same)
+    {
+        int ca = fgetc(fa);
+        int cb = fgetc(fb);
+        same = ca == cb;
+        if (ca == EOF)
+        {
+            break;
+        }
+    }
+    if (fa != NULL)
+    {
+        fclose(fa);
+    }
+    if (fb != NULL)
+    {
+        fclose(fb);
+    }
+    return same;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *transport = "socketpair";
+    int baud = 0;
+    int limit = 120;
+    int option;
+    while ((option = getopt(argc, argv, "t:e:s:b:l:")) != -1)
+    {
+        switch (option)
+        {
+        case 't':
+            transport = optarg;
+            break;
+        case 'e':
+            errorRate = atof(optarg);
+            break;
+        case 's':
+            rngState = strtoull(optarg, NULL, 10) * 0x9E3779B97F4A7C15ULL + 1;
+            break;
+        case 'b':
+            baud = atoi(optarg);
+            break;
+        case 'l':
+            limit = atoi(optarg);
+            break;
+        default:
+            return 2;
+        }
+    }
+    if (argc - optind != 2 || (strcmp(transport, "socketpair") != 0 && strcmp(transport, "pipe") != 0))
+    {
+        fprintf(stderr, "Usage: %s [-t socketpair|pipe] [-e rate] [-s seed] [-b baud] [-l seconds] main file\n", argv[0]);
+        return 2;
+    }
+    const char *main = argv[optind];
+    const char *file = argv[optind + 1];
+
+    // Each side gets its ends (txEnds / rxEnds), the relay keeps the others
+    int txEnds[2], rxEnds[2];
+    Direction toRx, toTx;
+    int fds[8];
+    if (strcmp(transport, "socketpair") == 0)
+    {
+        int tx[2], rx[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, tx) == -1 || socketpair(AF_UNIX, SOCK_STREAM, 0, rx) == -1)
+        {
+            perror("socketpair");
+            return 2;
+        }
+        txEnds[0] = txEnds[1] = tx[1];
+        rxEnds[0] = rxEnds[1] = rx[1];
+        toRx = (Direction){tx[0], rx[0], 0};
+        toTx = (Direction){rx[0], tx[0], 0};
+        memcpy(fds, (int[]){tx[0], tx[1], rx[0], rx[1]}, 4 * sizeof(int));
+    }
+    else
+    {
+        // A pipe for each side and direction: tx -> relay, relay -> rx, rx -> relay, relay -> tx
+        int txOut[2], rxIn[2], rxOut[2], txIn[2];
+        if (pipe(txOut) == -1 || pipe(rxIn) == -1 || pipe(rxOut) == -1 || pipe(txIn) == -1)
+        {
+            perror("pipe");
+            return 2;
+        }
+        txEnds[0] = txIn[0];
+        txEnds[1] = txOut[1];
+        rxEnds[0] = rxIn[0];
+        rxEnds[1] = rxOut[1];
+        toRx = (Direction){txOut[0], rxIn[1], 0};
+        toTx = (Direction){rxOut[0], txIn[1], 0};
+        memcpy(fds, (int[]){txOut[0], txOut[1], rxIn[0], rxIn[1], rxOut[0], rxOut[1], txIn[0], txIn[1]},
+               8 * sizeof(int));
+    }
+    int count = strcmp(transport, "pipe") == 0 ? 8 : 4;
+
+    char txPort[64], rxPort[64], received[256], txLog[256], rxLog[256];
+    if (strcmp(transport, "pipe") == 0)
+    {
+        snprintf(txPort, sizeof(txPort), "pipe:%d,%d", txEnds[0], txEnds[1]);
+        snprintf(rxPort, sizeof(rxPort), "pipe:%d,%d", rxEnds[0], rxEnds[1]);
+    }
+    else
+    {
+        snprintf(txPort, sizeof(txPort), "socketpair:%d", txEnds[0]);
+        snprintf(rxPort, sizeof(rxPort), "socketpair:%d", rxEnds[0]);
+    }
+    snprintf(received, sizeof(received), "%s.received", main);
+    snprintf(txLog, sizeof(txLog), "%s.tx.log", main);
+    snprintf(rxLog, sizeof(rxLog), "%s.rx.log", main);
+    unlink(received);
+
+    signal(SIGPIPE, SIG_IGN);
+    double start = monotonicSeconds();
+    pid_t rxPid = startSide(main, rxPort, "rx", received, rxLog, rxEnds, fds, count);
+    pid_t txPid = startSide(main, txPort, "tx", file, txLog, txEnds, fds, count);
+
+    // The relay only keeps its own ends
+    for (int i = 0; i < count; i++)
+    {
+        if (fds[i] != toRx.in && fds[i] != toRx.out && fds[i] != toTx.in && fds[i] != toTx.out)
+        {
+            close(fds[i]);
+        }
+    }
+    fcntl(toRx.in, F_SETFL, O_NONBLOCK);
+    fcntl(toTx.in, F_SETFL, O_NONBLOCK);
+
+    int txStatus = -1, rxStatus = -1;
+    int txOpen = 1, rxOpen = 1;
+    double last = start;
+    while (txStatus == -1 || rxStatus == -1)
+    {
+        double now = monotonicSeconds();
+        if (now - start > limit)
+        {
+            kill(txPid, SIGKILL);
+            kill(rxPid, SIGKILL);
+        }
+
+        // With a baud rate each direction carries baud / 10 bytes per second (start and stop bits)
+        if (baud > 0)
+        {
+            double refill = (now - last) * baud / 10;
+            double cap = baud / 100.0 > 16 ? baud / 100.0 : 16;
+            toRx.budget = toRx.budget + refill > cap ? cap : toRx.budget + refill;
+            toTx.budget = toTx.budget + refill > cap ? cap : toTx.budget + refill;
+        }
+        last = now;
+
+        struct pollfd pfds[2] = {{txOpen ? toRx.in : -1, POLLIN, 0}, {rxOpen ? toTx.in : -1, POLLIN, 0}};
+        poll(pfds, 2, baud > 0 ? 2 : 50);
+        if (txOpen && (pfds[0].revents & (POLLIN | POLLHUP)) && relay(&toRx, baud > 0) == -1)
+        {
+            // Like a cable pulled out: the other side stops getting bytes
+            txOpen = 0;
+            close(toRx.out);
+        }
+        if (rxOpen && (pfds[1].revents & (POLLIN | POLLHUP)) && relay(&toTx, baud > 0) == -1)
+        {
+            rxOpen = 0;
+            close(toTx.out);
+        }
+
+        int status;
+        if (txStatus == -1 && waitpid(txPid, &status, WNOHANG) == txPid)
+        {
+            txStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+        if (rxStatus == -1 && waitpid(rxPid, &status, WNOHANG) == rxPid)
+        {
+            rxStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+    }
+
+    int same = sameFiles(file, received);
+    printf("%s, error rate %g, %d baud: tx %d, rx %d, %.2fs, %s\n", transport, errorRate, baud, txStatus, rxStatus,
+           monotonicSeconds() - start, same ? "same file" : "DIFFERENT FILE");
+    return txStatus == 0 && rxStatus == 0 && same ? 0 : 1;
+}
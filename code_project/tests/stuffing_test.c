@@ -0,0 +1,348 @@
+// Stuffing test: the SIMD stuffing kernels (sse2, avx2) must write the same
+// frames and frame check sequences as the scalar one, on random buffers full of
+// flag (0x7E) and escape (0x7D) bytes. The SIMD destuffing kernels must give
+// back the same data as the scalar one when the stuffed data arrives in two
+// reads: split at and around the 16 and 32 byte blocks (an escape byte and the
+// byte it escapes in different blocks or reads), ending with a lone escape byte
+// or limited by the size of the destination.
+//
+// Usage: stuffing_test [buffers]
+// Exits with 0 when every kernel the CPU supports agrees with the scalar one.
+//
+// Usage: stuffing_test -b [megabytes]
+// Benchmark: times each kernel the CPU supports on that much data (default 16),
+// stuffed and destuffed in frames of 4096 bytes, and prints the bytes per cycle
+// of the time stamp counter (at the nominal clock of the CPU) and the GB/s.
+
+#include "fcs.h"
+#include "stuffing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#define MAX_BUFFER_SIZE 3000
+
+#define BENCH_FRAME 4096 // Bytes of data in each frame of the benchmark
+#define BENCH_PASSES 5 // The fastest pass is kept
+
+static unsigned long long rngState = 1;
+
+// xorshift64*, the same buffers on every machine.
+static unsigned int nextRandom()
+{
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return (unsigned int)((rngState * 2685821657736338717ULL) >> 32);
+}
+
+// Mostly flags and escapes, in runs and alone, with some other bytes between them.
+static void randomBuffer(unsigned char *buffer, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        unsigned int r = nextRandom() % 10;
+        buffer[i] = r < 4 ? 0x7E : r < 7 ? 0x7D : r < 8 ? (0x7E ^ 0x20) : nextRandom() & 0xFF;
+    }
+}
+
+// Stuff size bytes of src with the kernels called name into dst.
+// Returns the size of the stuffed data.
+static int stuffWith(const char *name, unsigned char *dst, const unsigned char *src, int size, int fcsType,
+                     unsigned char *fcs)
+{
+    useStuffingKernel(name);
+    return stuffData(dst, src, size, fcsType, fcs);
+}
+
+// Result of destuffing the stuffed data in two reads.
+typedef struct
+{
+    int consumed;
+    int written;
+    int escaped;
+} Destuffed;
+
+// Destuff src with the kernels called name: split bytes in the first read, the
+// rest in the second one, writing at most dstSize bytes.
+static Destuffed destuffWith(const char *name, unsigned char *dst, int dstSize, const unsigned char *src, int size,
+                             int split)
+{
+    useStuffingKernel(name);
+    Destuffed result = {0, 0, 0};
+    int written = 0;
+    result.consumed = destuffData(dst, dstSize, src, split, &written, &result.escaped);
+    result.written = written;
+
+    // The second read starts where the first one stopped (a flag or a full destination stop both)
+    if (result.consumed == split && result.written < dstSize)
+    {
+        result.consumed += destuffData(dst + result.written, dstSize - result.written, src + split, size - split,
+                                       &written, &result.escaped);
+        result.written += written;
+    }
+    return result;
+}
+
+// Splits tried for each stuffed buffer: around the blocks of 16 and 32 bytes, and a random one.
+static const int splits[] = {0, 1, 15, 16, 17, 31, 32, 33, 47, 48, 49, 63, 64, 65};
+
+// Compare the destuffing kernel called name with the scalar one.
+// Returns the number of buffers where they differ.
+static int checkDestuffing(const char *name, int buffers)
+{
+    static unsigned char data[MAX_BUFFER_SIZE];
+    static unsigned char stuffed[2 * MAX_BUFFER_SIZE + 32 + 1];
+    static unsigned char expected[MAX_BUFFER_SIZE];
+    static unsigned char actual[MAX_BUFFER_SIZE];
+
+    rngState = 1;
+    int failures = 0;
+    int checked = 0;
+    for (int b = 0; b < buffers; b++)
+    {
+        int size = nextRandom() % (MAX_BUFFER_SIZE + 1);
+        randomBuffer(data, size);
+
+        // The stuffed data starts at any offset of a 32 byte block
+        int offset = nextRandom() % 32;
+        unsigned char fcs[MAX_FCS_SIZE];
+        useStuffingKernel("scalar");
+        int stuffedSize = stuffData(stuffed + offset, data, size, FCS_BCC2, fcs);
+
+        // Ends with the closing flag, with a lone escape byte (the last read of a frame that continues), or at the
+        // end of the bytes read
+        int ending = b % 3;
+        if (ending == 0)
+        {
+            stuffed[offset + stuffedSize++] = 0x7E;
+        }
+        else if (ending == 1)
+        {
+            stuffed[offset + stuffedSize++] = 0x7D;
+        }
+
+        // Sometimes a destination smaller than the data
+        int dstSize = b % 5 == 0 && size > 0 ? (int)(nextRandom() % size) : MAX_BUFFER_SIZE;
+
+        int count = sizeof(splits) / sizeof(splits[0]);
+        for (int s = 0; s <= count; s++)
+        {
+            int split = s < count ? splits[s] : (int)(nextRandom() % (stuffedSize + 1));
+            if (split > stuffedSize)
+            {
+                continue;
+            }
+
+            Destuffed e = destuffWith("scalar", expected, dstSize, stuffed + offset, stuffedSize, split);
+            Destuffed a = destuffWith(name, actual, dstSize, stuffed + offset, stuffedSize, split);
+            if (a.consumed != e.consumed || a.written != e.written || a.escaped != e.escaped ||
+                memcmp(actual, expected, e.written) != 0 || (dstSize >= size && memcmp(expected, data, size) != 0))
+            {
+                printf("destuffing: %s differs from scalar on buffer %d (%d bytes at offset %d, split at %d)\n", name,
+                       b, stuffedSize, offset, split);
+                failures++;
+                break;
+            }
+        }
+        checked++;
+    }
+    printf("destuffing: %s same as scalar on %d buffers\n", name, checked - failures);
+    return failures;
+}
+
+static double monotonicSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Cycles of the time stamp counter, which counts at the nominal clock of the
+// CPU. Nanoseconds on other CPUs.
+static unsigned long long cycles()
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return (unsigned long long)(monotonicSeconds() * 1e9);
+#endif
+}
+
+// Cycles per second of the counter, measured against the monotonic clock.
+static double cyclesPerSecond()
+{
+    double start = monotonicSeconds();
+    unsigned long long startCycles = cycles();
+    while (monotonicSeconds() - start < 0.1)
+        ;
+    return (cycles() - startCycles) / (monotonicSeconds() - start);
+}
+
+// Stuff size bytes of data in frames of BENCH_FRAME bytes with the kernels
+// called name, destuff them again and print the bytes per cycle of both.
+// Returns -1 if the data destuffed is not the data.
+static int benchmark(const char *name, const char *kind, const unsigned char *data, int size, double rate)
+{
+    int frames = size / BENCH_FRAME;
+    unsigned char *stuffed = malloc((size_t)frames * 2 * BENCH_FRAME);
+    unsigned char *destuffed = malloc((size_t)frames * BENCH_FRAME);
+    int *stuffedSizes = malloc(sizeof(int) * frames);
+    if (stuffed == NULL || destuffed == NULL || stuffedSizes == NULL)
+    {
+        printf("benchmark: not enough memory\n");
+        exit(1);
+    }
+
+    useStuffingKernel(name);
+    unsigned long long bestStuffing = ~0ULL;
+    unsigned long long bestDestuffing = ~0ULL;
+    for (int pass = 0; pass < BENCH_PASSES; pass++)
+    {
+        unsigned char fcs[MAX_FCS_SIZE];
+        unsigned long long start = cycles();
+        for (int f = 0; f < frames; f++)
+        {
+            stuffedSizes[f] = stuffData(stuffed + (size_t)f * 2 * BENCH_FRAME, data + (size_t)f * BENCH_FRAME,
+                                        BENCH_FRAME, FCS_BCC2, fcs);
+        }
+        unsigned long long middle = cycles();
+        for (int f = 0; f < frames; f++)
+        {
+            int written = 0;
+            int escaped = 0;
+            destuffData(destuffed + (size_t)f * BENCH_FRAME, BENCH_FRAME, stuffed + (size_t)f * 2 * BENCH_FRAME,
+                        stuffedSizes[f], &written, &escaped);
+        }
+        unsigned long long end = cycles();
+
+        if (middle - start < bestStuffing)
+        {
+            bestStuffing = middle - start;
+        }
+        if (end - middle < bestDestuffing)
+        {
+            bestDestuffing = end - middle;
+        }
+    }
+
+    long long bytes = (long long)frames * BENCH_FRAME;
+    int same = memcmp(destuffed, data, bytes) == 0;
+    printf("benchmark: %-6s %-6s data: stuffing %.2f bytes/cycle (%.2f GB/s), destuffing %.2f bytes/cycle "
+           "(%.2f GB/s)%s\n",
+           stuffingKernel(), kind, (double)bytes / bestStuffing, bytes * rate / bestStuffing / 1e9,
+           (double)bytes / bestDestuffing, bytes * rate / bestDestuffing / 1e9, same ? "" : ", DIFFERENT DATA");
+
+    free(stuffed);
+    free(destuffed);
+    free(stuffedSizes);
+    return same ? 0 : -1;
+}
+
+// Benchmark every kernel the CPU supports on random bytes (like compressed
+// data, few bytes to escape) and on the flag and escape bytes of the tests.
+static int benchmarkKernels(int megabytes)
+{
+    int size = megabytes * 1024 * 1024;
+    unsigned char *data = malloc(size);
+    if (data == NULL || size < BENCH_FRAME)
+    {
+        printf("benchmark: can't use %d MB of data\n", megabytes);
+        return 1;
+    }
+
+    double rate = cyclesPerSecond();
+    printf("benchmark: %d MB in frames of %d bytes, counter at %.2f GHz\n", megabytes, BENCH_FRAME, rate / 1e9);
+
+    const char *kernels[] = {"scalar", "sse2", "avx2"};
+    int failures = 0;
+    for (int d = 0; d < 2; d++)
+    {
+        rngState = 1;
+        if (d == 0)
+        {
+            for (int i = 0; i < size; i++)
+            {
+                data[i] = nextRandom() & 0xFF;
+            }
+        }
+        else
+        {
+            randomBuffer(data, size);
+        }
+
+        for (int k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++)
+        {
+            if (useStuffingKernel(kernels[k]) == -1)
+            {
+                printf("benchmark: %s not supported by this CPU, skipped\n", kernels[k]);
+                continue;
+            }
+            failures += benchmark(kernels[k], d == 0 ? "random" : "flags", data, size, rate) == -1;
+        }
+    }
+    free(data);
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "-b") == 0)
+    {
+        return benchmarkKernels(argc > 2 ? atoi(argv[2]) : 16);
+    }
+
+    int buffers = argc > 1 ? atoi(argv[1]) : 2000;
+    const char *kernels[] = {"sse2", "avx2"};
+
+    // The source starts at any offset of a 32 byte block
+    static unsigned char src[MAX_BUFFER_SIZE + 32];
+    static unsigned char expected[2 * MAX_BUFFER_SIZE];
+    static unsigned char actual[2 * MAX_BUFFER_SIZE];
+
+    int failures = 0;
+    for (int k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++)
+    {
+        if (useStuffingKernel(kernels[k]) == -1)
+        {
+            printf("stuffing: %s not supported by this CPU, skipped\n", kernels[k]);
+            continue;
+        }
+
+        rngState = 1;
+        int checked = 0;
+        for (int b = 0; b < buffers; b++)
+        {
+            int size = nextRandom() % (MAX_BUFFER_SIZE + 1);
+            int offset = nextRandom() % 32;
+            int fcsType = b % 2 == 0 ? FCS_BCC2 : FCS_CRC32C;
+            randomBuffer(src + offset, size);
+
+            unsigned char expectedFcs[MAX_FCS_SIZE] = {0};
+            unsigned char actualFcs[MAX_FCS_SIZE] = {0};
+            int expectedSize = stuffWith("scalar", expected, src + offset, size, fcsType, expectedFcs);
+            int actualSize = stuffWith(kernels[k], actual, src + offset, size, fcsType, actualFcs);
+
+            if (actualSize != expectedSize || memcmp(actual, expected, expectedSize) != 0 ||
+                memcmp(actualFcs, expectedFcs, fcsSize(fcsType)) != 0)
+            {
+                printf("stuffing: %s differs from scalar on buffer %d (%d bytes at offset %d, %s)\n", kernels[k], b,
+                       size, offset, fcsName(fcsType));
+                failures++;
+                continue;
+            }
+            checked++;
+        }
+        printf("stuffing: %s same as scalar on %d buffers\n", stuffingKernel(), checked);
+
+        failures += checkDestuffing(kernels[k], buffers);
+    }
+
+    return failures == 0 ? 0 : 1;
+}